@@ -6,10 +6,14 @@
  */
 
 #include <chrono>
+#include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
 
 #include "core/libcamera_encoder.hpp"
 #include "output/output.hpp"
@@ -60,6 +64,63 @@ static int get_colourspace_flags(std::string const &codec)
 		return LibcameraEncoder::FLAG_VIDEO_NONE;
 }
 
+// The encoder control channel is a FIFO that other processes can write commands to while we record.
+
+static int open_encoder_control(std::string const &filename)
+{
+	if (filename.empty())
+		return -1;
+	if (mkfifo(filename.c_str(), 0666) < 0 && errno != EEXIST)
+		throw std::runtime_error("failed to create encoder control FIFO " + filename);
+	// Opening it read/write means we never see end-of-file when a writer goes away.
+	int fd = open(filename.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to open encoder control FIFO " + filename);
+	LOG(2, "Reading encoder commands from " << filename);
+	return fd;
+}
+
+static void encoder_command(LibcameraEncoder &app, std::string const &line)
+{
+	std::istringstream command(line);
+	std::string name;
+	if (!(command >> name))
+		return;
+
+	// Commands may end with the number of the simulcast encoder they're for, otherwise they go to the main one.
+	bool ok = false;
+	unsigned int index = 0;
+	if (name == "bitrate")
+	{
+		unsigned int bitrate;
+		ok = (command >> bitrate) && (command >> index || command.eof()) && app.SetEncodeBitrate(bitrate, index);
+	}
+	else if (name == "quality")
+	{
+		int quality;
+		ok = (command >> quality) && (command >> index || command.eof()) && app.SetEncodeQuality(quality, index);
+	}
+	else if (name == "keyframe")
+		ok = (command >> index || command.eof()) && app.ForceKeyframe(index);
+
+	if (ok)
+		LOG(1, "Encoder command: " << line);
+	else
+		LOG(1, "Encoder command failed or not supported: " << line);
+}
+
+static void read_encoder_control(LibcameraEncoder &app, int fd, std::string &pending)
+{
+	if (fd < 0)
+		return;
+	char buf[256];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		pending.append(buf, n);
+	for (size_t end; (end = pending.find('\n')) != std::string::npos; pending.erase(0, end + 1))
+		encoder_command(app, pending.substr(0, end));
+}
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraEncoder &app)
@@ -67,7 +128,24 @@ static void event_loop(LibcameraEncoder &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
+	app.SetEncodeQualityReadyCallback(std::bind(&Output::QualityReady, output.get(), _1));
+
+	// Each simulcast encoder gets its own options and output.
+	std::vector<std::unique_ptr<VideoOptions>> simulcast_options;
+	std::vector<std::unique_ptr<Output>> simulcast_outputs;
+	for (auto const &spec : options->simulcast)
+	{
+		std::string stream;
+		simulcast_options.push_back(options->SimulcastOptions(spec, stream));
+		simulcast_outputs.push_back(std::unique_ptr<Output>(Output::Create(simulcast_options.back().get())));
+		Output *simulcast_output = simulcast_outputs.back().get();
+		app.AddSimulcastEncoder(simulcast_options.back().get(), stream,
+								std::bind(&Output::OutputReady, simulcast_output, _1, _2, _3, _4),
+								std::bind(&Output::QualityReady, simulcast_output, _1));
+		LOG(1, "Simulcast " << simulcast_outputs.size() << ": " << simulcast_options.back()->codec << " of the "
+							<< stream << " stream to " << simulcast_options.back()->output);
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
@@ -80,6 +158,8 @@ static void event_loop(LibcameraEncoder &app)
 	signal(SIGUSR2, default_signal_handler);
 	signal(SIGINT, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+	int control_fd = open_encoder_control(options->encoder_control);
+	std::string control_pending;
 
 	for (unsigned int count = 0; ; count++)
 	{
@@ -92,12 +172,16 @@ static void event_loop(LibcameraEncoder &app)
 			continue;
 		}
 		if (msg.type == LibcameraEncoder::MsgType::Quit)
-			return;
+			break;
 		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
+		{
 			output->Signal();
+			for (auto &simulcast_output : simulcast_outputs)
+				simulcast_output->Signal();
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -110,13 +194,25 @@ static void event_loop(LibcameraEncoder &app)
 				LOG(1, "Halting: reached timeout of " << options->timeout << " milliseconds.");
 			app.StopCamera(); // stop complains if encoder very slow to close
 			app.StopEncoder();
-			return;
+			break;
+		}
+
+		read_encoder_control(app, control_fd, control_pending);
+		if (output->KeyframeWanted())
+			app.ForceKeyframe();
+		for (unsigned int i = 0; i < simulcast_outputs.size(); i++)
+		{
+			if (simulcast_outputs[i]->KeyframeWanted())
+				app.ForceKeyframe(i + 1);
 		}
 
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 		app.EncodeBuffer(completed_request, app.VideoStream());
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
+
+	if (control_fd >= 0)
+		close(control_fd);
 }
 
 int main(int argc, char *argv[])
@@ -4,10 +4,20 @@
  *
  * frame_info.hpp - Frame info class for libcamera apps
  */
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
 #include <array>
-#include <iomanip>
-#include <sstream>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/controls.h>
@@ -44,43 +54,9 @@ struct FrameInfo
 			aelock = *ae;
 	}
 
-	std::string ToString(std::string &info_string) const
-	{
-		std::string parsed(info_string);
-
-		for (auto const &t : tokens)
-		{
-			std::size_t pos = parsed.find(t);
-			if (pos != std::string::npos)
-			{
-				std::stringstream value;
-				value << std::fixed << std::setprecision(2);
-
-				if (t == "%frame")
-					value << sequence;
-				else if (t == "%fps")
-					value << fps;
-				else if (t == "%exp")
-					value << exposure_time;
-				else if (t == "%ag")
-					value << analogue_gain;
-				else if (t == "%dg")
-					value << digital_gain;
-				else if (t == "%rg")
-					value << colour_gains[0];
-				else if (t == "%bg")
-					value << colour_gains[1];
-				else if (t == "%focus")
-					value << focus;
-				else if (t == "%aelock")
-					value << aelock;
-
-				parsed.replace(pos, t.length(), value.str());
-			}
-		}
-
-		return parsed;
-	}
+	// Convenient, but compiles the string every time. Where the same string is used
+	// repeatedly, keep an InfoText and call its Format method instead.
+	std::string ToString(std::string &info_string) const;
 
 	unsigned int sequence;
 	float exposure_time;
@@ -90,9 +66,215 @@ struct FrameInfo
 	float focus;
 	float fps;
 	bool aelock;
+};
+
+// An info text string (such as the --info-text option, or the annotate_cv text) compiled
+// into a list of literal and field operations, so that it doesn't have to be searched
+// for every token on every frame. Results are formatted into a buffer owned by the
+// InfoText, so a returned string_view is only good until the next call. Anything
+// left over that looks like a strftime directive can also be expanded, and as these
+// only change once a second their results are cached.
+
+class InfoText
+{
+public:
+	InfoText() : compiled_(false), cache_time_(-1) {}
+	explicit InfoText(std::string const &text) : InfoText() { Compile(text); }
+
+	// Compile the string, unless it's the one we compiled last time.
+	void Compile(std::string const &text)
+	{
+		if (compiled_ && text == text_)
+			return;
+
+		text_ = text;
+		compiled_ = true;
+		cache_time_ = -1;
+		ops_.clear();
+		time_cache_.clear();
+
+		size_t literal_start = 0;
+		for (size_t pos = 0; pos < text_.size();)
+		{
+			Field field = text_[pos] == '%' ? matchField(pos) : Field::Literal;
+			if (field == Field::Literal)
+			{
+				pos++;
+				continue;
+			}
+			addLiteral(literal_start, pos);
+			ops_.push_back({ field, 0, 0, 0 });
+			pos += fields_[static_cast<int>(field)].size();
+			literal_start = pos;
+		}
+		addLiteral(literal_start, text_.size());
+	}
+
+	std::string const &Text() const { return text_; }
+
+	// Substitute the frame info fields only.
+	std::string_view Format(FrameInfo const &info) { return format(info, false); }
+
+	// Also expand any strftime directives for the given time.
+	std::string_view Format(FrameInfo const &info, time_t now)
+	{
+		if (now != cache_time_)
+		{
+			cache_time_ = now;
+			tm *tm_ptr = localtime(&now);
+			for (auto const &op : ops_)
+			{
+				if (op.field != Field::TimeLiteral)
+					continue;
+				std::string fmt = text_.substr(op.offset, op.length);
+				char expanded[256];
+				size_t len = strftime(expanded, sizeof(expanded), fmt.c_str(), tm_ptr);
+				time_cache_[op.cache] = len ? std::string(expanded, len) : fmt;
+			}
+		}
+		return format(info, true);
+	}
 
 private:
-	// Info text tokens.
-	inline static const std::string tokens[] = { "%frame", "%fps", "%exp",	 "%ag",	   "%dg",
-												 "%rg",	   "%bg",  "%focus", "%aelock" };
+	enum class Field
+	{
+		Frame,
+		Fps,
+		Exp,
+		Ag,
+		Dg,
+		Rg,
+		Bg,
+		Focus,
+		AeLock,
+		Literal,
+		TimeLiteral
+	};
+	struct Op
+	{
+		Field field;
+		size_t offset; // into text_, for literals
+		size_t length;
+		size_t cache; // into time_cache_, for time literals
+	};
+
+	// Info text tokens, in the same order as the Field enum.
+	inline static const std::string fields_[] = { "%frame", "%fps", "%exp",	 "%ag",	   "%dg",
+												  "%rg",	"%bg",	"%focus", "%aelock" };
+
+	Field matchField(size_t pos) const
+	{
+		for (unsigned int i = 0; i < std::size(fields_); i++)
+		{
+			if (text_.compare(pos, fields_[i].size(), fields_[i]) == 0)
+				return static_cast<Field>(i);
+		}
+		return Field::Literal;
+	}
+
+	void addLiteral(size_t start, size_t end)
+	{
+		if (end <= start)
+			return;
+		// Any remaining % must be for strftime.
+		bool has_time = std::memchr(text_.data() + start, '%', end - start) != nullptr;
+		if (has_time)
+		{
+			ops_.push_back({ Field::TimeLiteral, start, end - start, time_cache_.size() });
+			time_cache_.push_back(text_.substr(start, end - start));
+		}
+		else
+			ops_.push_back({ Field::Literal, start, end - start, 0 });
+	}
+
+	// All the helpers below truncate the output if it would overflow the buffer.
+	static char *putString(char *p, char *end, std::string_view s)
+	{
+		size_t n = std::min<size_t>(s.size(), end - p);
+		std::memcpy(p, s.data(), n);
+		return p + n;
+	}
+
+	static char *putUint(char *p, char *end, uint64_t value)
+	{
+		auto result = std::to_chars(p, end, value);
+		return result.ec == std::errc() ? result.ptr : p;
+	}
+
+	// Fixed point with 2 decimal places, as std::fixed with std::setprecision(2) would give.
+	static char *putFixed2(char *p, char *end, float value)
+	{
+		if (!std::isfinite(value) || std::fabs(value) >= 1e15)
+		{
+			char tmp[32];
+			int n = snprintf(tmp, sizeof(tmp), "%.2f", value);
+			return putString(p, end, std::string_view(tmp, std::max(n, 0)));
+		}
+		uint64_t hundredths = std::nearbyint(std::fabs(static_cast<double>(value)) * 100.0);
+		if (std::signbit(value) && p < end)
+			*p++ = '-';
+		p = putUint(p, end, hundredths / 100);
+		char frac[3] = { '.', static_cast<char>('0' + (hundredths / 10) % 10), static_cast<char>('0' + hundredths % 10) };
+		return putString(p, end, std::string_view(frac, 3));
+	}
+
+	std::string_view format(FrameInfo const &info, bool expand_time)
+	{
+		char *p = buffer_.data(), *end = p + buffer_.size();
+		for (auto const &op : ops_)
+		{
+			switch (op.field)
+			{
+			case Field::Literal:
+				p = putString(p, end, std::string_view(text_).substr(op.offset, op.length));
+				break;
+			case Field::TimeLiteral:
+				p = putString(p, end,
+							  expand_time ? std::string_view(time_cache_[op.cache])
+										  : std::string_view(text_).substr(op.offset, op.length));
+				break;
+			case Field::Frame:
+				p = putUint(p, end, info.sequence);
+				break;
+			case Field::Fps:
+				p = putFixed2(p, end, info.fps);
+				break;
+			case Field::Exp:
+				p = putFixed2(p, end, info.exposure_time);
+				break;
+			case Field::Ag:
+				p = putFixed2(p, end, info.analogue_gain);
+				break;
+			case Field::Dg:
+				p = putFixed2(p, end, info.digital_gain);
+				break;
+			case Field::Rg:
+				p = putFixed2(p, end, info.colour_gains[0]);
+				break;
+			case Field::Bg:
+				p = putFixed2(p, end, info.colour_gains[1]);
+				break;
+			case Field::Focus:
+				p = putFixed2(p, end, info.focus);
+				break;
+			case Field::AeLock:
+				p = putUint(p, end, info.aelock);
+				break;
+			}
+		}
+		return std::string_view(buffer_.data(), p - buffer_.data());
+	}
+
+	std::string text_;
+	bool compiled_;
+	std::vector<Op> ops_;
+	time_t cache_time_;
+	std::vector<std::string> time_cache_;
+	std::array<char, 512> buffer_;
 };
+
+inline std::string FrameInfo::ToString(std::string &info_string) const
+{
+	InfoText info_text(info_string);
+	return std::string(info_text.Format(*this));
+}
@@ -899,6 +899,11 @@ void LibcameraApp::stopPreview()
 
 void LibcameraApp::previewThread()
 {
+	// Setting the info text can be expensive (e.g. a window title update), so only do it
+	// when it actually changes.
+	std::string last_info_text;
+	InfoText info_text(options_->info_text);
+
 	while (true)
 	{
 		PreviewItem item;
@@ -943,8 +948,12 @@ void LibcameraApp::previewThread()
 		preview_->Show(fd, span, info);
 		if (!options_->info_text.empty())
 		{
-			std::string s = frame_info.ToString(options_->info_text);
-			preview_->SetInfoText(s);
+			std::string_view s = info_text.Format(frame_info);
+			if (s != last_info_text)
+			{
+				last_info_text = s;
+				preview_->SetInfoText(last_info_text);
+			}
 		}
 	}
 }
@@ -5,6 +5,8 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <map>
+
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
@@ -12,7 +14,8 @@
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
-typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
+typedef std::function<void(libcamera::ControlList &, int64_t)> MetadataReadyCallback;
+typedef std::function<void(int)> EncodeQualityReadyCallback;
 
 class LibcameraEncoder : public LibcameraApp
 {
@@ -25,31 +28,77 @@ public:
 	void StartEncoder()
 	{
 		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
+		encoder_->SetInputDoneCallback(
+			std::bind(&LibcameraEncoder::encodeBufferDone, this, &encode_buffers_, std::placeholders::_1));
 		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetQualityReadyCallback(encode_quality_ready_callback_);
+
+		for (auto &simulcast : simulcast_)
+		{
+			StreamInfo info;
+			GetStream(simulcast->stream, &info);
+			if (!info.width || !info.height || !info.stride)
+				throw std::runtime_error("simulcast " + simulcast->stream + " stream is not configured");
+			simulcast->encoder = std::unique_ptr<Encoder>(Encoder::Create(simulcast->options, info));
+			simulcast->encoder->SetInputDoneCallback(
+				std::bind(&LibcameraEncoder::encodeBufferDone, this, &simulcast->buffers, std::placeholders::_1));
+			simulcast->encoder->SetOutputReadyCallback(simulcast->output_ready_callback);
+			simulcast->encoder->SetQualityReadyCallback(simulcast->quality_ready_callback);
+		}
 	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Tells you the quality the encoder used for the frame that's about to be output.
+	void SetEncodeQualityReadyCallback(EncodeQualityReadyCallback callback)
+	{
+		encode_quality_ready_callback_ = callback;
+	}
+	// Simulcast encoders run alongside the main one, each encoding the named stream ("video" or
+	// "lores") with its own options and callbacks. They must be added before StartEncoder, and are
+	// numbered from 1 (the main encoder being 0) by the encoder controls below.
+	void AddSimulcastEncoder(VideoOptions const *options, std::string const &stream,
+							 EncodeOutputReadyCallback output_ready_callback,
+							 EncodeQualityReadyCallback quality_ready_callback)
+	{
+		simulcast_.push_back(std::make_unique<SimulcastEncoder>());
+		simulcast_.back()->options = options;
+		simulcast_.back()->stream = stream;
+		simulcast_.back()->output_ready_callback = output_ready_callback;
+		simulcast_.back()->quality_ready_callback = quality_ready_callback;
+	}
+	// Encode the request's buffer for the given stream, then hand the request to any simulcast encoders.
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
-		StreamInfo info = GetStreamInfo(stream);
-		FrameBuffer *buffer = completed_request->buffers[stream];
-		libcamera::Span span = Mmap(buffer)[0];
-		void *mem = span.data();
-		if (!buffer || !mem)
-			throw std::runtime_error("no buffer to encode");
-		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
-		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
-		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
-		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+		encode(encoder_.get(), encode_buffers_, completed_request, stream, true);
+		for (auto &simulcast : simulcast_)
+			encode(simulcast->encoder.get(), simulcast->buffers, completed_request, GetStream(simulcast->stream),
+				   false);
+	}
+	// Change an encoder's settings on the fly. These return false if the encoder can't do it.
+	bool SetEncodeBitrate(unsigned int bitrate, unsigned int index = 0)
+	{
+		Encoder *encoder = getEncoder(index);
+		return encoder && encoder->SetBitrate(bitrate);
+	}
+	bool SetEncodeQuality(int quality, unsigned int index = 0)
+	{
+		Encoder *encoder = getEncoder(index);
+		return encoder && encoder->SetQuality(quality);
+	}
+	bool ForceKeyframe(unsigned int index = 0)
+	{
+		Encoder *encoder = getEncoder(index);
+		return encoder && encoder->ForceKeyframe();
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		encoder_.reset();
+		for (auto &simulcast : simulcast_)
+			simulcast->encoder.reset();
+	}
 
 protected:
 	virtual void createEncoder()
@@ -63,26 +112,70 @@ protected:
 	std::unique_ptr<Encoder> encoder_;
 
 private:
-	void encodeBufferDone(void *mem)
+	// Requests whose buffers are with an encoder, keyed by the buffer's mapped address. Every
+	// encoder holds its own references, so a request is recycled only once they've all finished.
+	struct EncodeBuffers
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		std::map<void *, CompletedRequestPtr> requests;
+		std::mutex mutex;
+	};
+
+	struct SimulcastEncoder
+	{
+		VideoOptions const *options;
+		std::string stream;
+		EncodeOutputReadyCallback output_ready_callback;
+		EncodeQualityReadyCallback quality_ready_callback;
+		// The encoder must go first, as it may still return buffers as it closes.
+		EncodeBuffers buffers;
+		std::unique_ptr<Encoder> encoder;
+	};
+
+	Encoder *getEncoder(unsigned int index)
+	{
+		if (index == 0)
+			return encoder_.get();
+		return index <= simulcast_.size() ? simulcast_[index - 1]->encoder.get() : nullptr;
+	}
+
+	void encode(Encoder *encoder, EncodeBuffers &buffers, CompletedRequestPtr &completed_request, Stream *stream,
+				bool metadata)
+	{
+		StreamInfo info = GetStreamInfo(stream);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		if (!buffer)
+			throw std::runtime_error("no buffer to encode");
+		libcamera::Span span = Mmap(buffer)[0];
+		void *mem = span.data();
+		if (!mem)
+			throw std::runtime_error("no buffer to encode");
+		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		// The output matches this up with the encoded frame using the timestamp, as frames
+		// may finish encoding in any order (or not at all).
+		if (metadata && metadata_ready_callback_ && !GetOptions()->metadata.empty())
+			metadata_ready_callback_(completed_request->metadata, timestamp_ns / 1000);
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			std::lock_guard<std::mutex> lock(buffers.mutex);
+			buffers.requests[mem] = completed_request; // creates a new reference
 		}
+		encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+	}
+
+	void encodeBufferDone(EncodeBuffers *buffers, void *mem)
+	{
+		// The encoder tells us which buffer it has finished with, so we can return that
+		// request straight away, whatever order the encoder completes them in.
+		std::lock_guard<std::mutex> lock(buffers->mutex);
+		auto it = buffers->requests.find(mem);
+		if (it == buffers->requests.end())
+			throw std::runtime_error("no buffer available to return");
+		buffers->requests.erase(it); // drop shared_ptr reference
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
+	EncodeBuffers encode_buffers_;
+	std::vector<std::unique_ptr<SimulcastEncoder>> simulcast_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
+	EncodeQualityReadyCallback encode_quality_ready_callback_;
 };
@@ -63,6 +63,10 @@ bool Options::Parse(int argc, char *argv[])
 		notify(vm);
 	}
 
+	// Most of the apps only have one output, which is the first (and only) one they were given.
+	if (!outputs.empty())
+		output = outputs.front();
+
 	// This is to get round the fact that the boost option parser does not
 	// allow std::optional types.
 	if (framerate_ != -1.0)
@@ -10,6 +10,7 @@
 #include <fstream>
 #include <iostream>
 #include <optional>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
@@ -69,8 +70,8 @@ struct Options
 			 "Set the output image height (0 = use default value)")
 			("timeout,t", value<uint64_t>(&timeout)->default_value(5000),
 			 "Time (in ms) for which program runs")
-			("output,o", value<std::string>(&output),
-			 "Set the output file name")
+			("output,o", value<std::vector<std::string>>(&outputs)->composing(),
+			 "Set the output file name. libcamera-vid accepts more than one, and sends the video to all of them.")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
@@ -160,6 +161,7 @@ struct Options
 	uint64_t timeout; // in ms
 	std::string config_file;
 	std::string output;
+	std::vector<std::string> outputs;
 	std::string post_process_file;
 	unsigned int width;
 	unsigned int height;
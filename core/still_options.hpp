@@ -32,6 +32,9 @@ struct StillOptions : public Options
 			 "Use system timestamps for output file names")
 			("restart", value<unsigned int>(&restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("strips", value<unsigned int>(&strips)->default_value(1),
+			 "Split the JPEG into this many horizontal strips which are encoded in parallel. "
+			 "This overrides the restart interval")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -57,6 +60,7 @@ struct StillOptions : public Options
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	unsigned int strips;
 	bool keypress;
 	bool signal;
 	std::string thumb;
@@ -70,6 +74,8 @@ struct StillOptions : public Options
 	{
 		if (Options::Parse(argc, argv) == false)
 			return false;
+		if (outputs.size() > 1)
+			throw std::runtime_error("only one output file may be given");
 		if ((keypress || signal) && timelapse)
 			throw std::runtime_error("keypress/signal and timelapse options are mutually exclusive");
 		if (strcasecmp(thumb.c_str(), "none") == 0)
@@ -97,6 +103,7 @@ struct StillOptions : public Options
 		std::cerr << "    quality: " << quality << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
+		std::cerr << "    strips: " << strips << std::endl;
 		std::cerr << "    timelapse: " << timelapse << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
 		std::cerr << "    datetime: " << datetime << std::endl;
@@ -9,7 +9,10 @@
 
 #include <cstdio>
 
+#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "options.hpp"
 
@@ -23,13 +26,19 @@ struct VideoOptions : public Options
 		// clang-format off
 		options_.add_options()
 			("bitrate,b", value<uint32_t>(&bitrate)->default_value(0),
-			 "Set the video bitrate for encoding, in bits/second (h264 only)")
+			 "Set the video bitrate for encoding, in bits/second (for mjpeg this enables rate control)")
 			("profile", value<std::string>(&profile),
 			 "Set the encoding profile (h264 only)")
 			("level", value<std::string>(&level),
 			 "Set the encoding level (h264 only)")
 			("intra,g", value<unsigned int>(&intra)->default_value(0),
 			 "Set the intra frame period (h264 only)")
+			("h264-buffers", value<unsigned int>(&h264_buffers)->default_value(6),
+			 "Number of input buffers to give the encoder, which should be at least the number of camera buffers "
+			 "(h264 only)")
+			("h264-overflow", value<std::string>(&h264_overflow)->default_value("wait"),
+			 "What to do with a frame when the encoder has no free input buffers, either wait (for up to a second) "
+			 "or drop (h264 only)")
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
@@ -42,27 +51,78 @@ struct VideoOptions : public Options
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("mjpeg-threads", value<unsigned int>(&mjpeg_threads)->default_value(0),
+			 "Number of threads to use for encoding, 0 meaning one per core (mjpeg only)")
+			("mjpeg-strips", value<unsigned int>(&mjpeg_strips)->default_value(1),
+			 "Split each frame into this many horizontal strips which are encoded in parallel, "
+			 "reducing latency (mjpeg only)")
+			("mjpeg-smoothing", value<unsigned int>(&mjpeg_smoothing)->default_value(10),
+			 "Number of frames over which rate control averages the bitrate (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Listen for incoming tcp client connections, and send data to all the clients")
+			("rtp-mtu", value<unsigned int>(&rtp_mtu)->default_value(1500),
+			 "Largest IP packet to send for rtp:// output, which H.264 NAL units are split up to fit")
+			("rtp-pacing", value<uint32_t>(&rtp_pacing)->default_value(0),
+			 "Limit rtp:// output to this many bits/second, so that big frames don't go out in one burst, or 0 "
+			 "for no limit. It should be well above the video bitrate.")
+			("mpegts", value<bool>(&mpegts)->default_value(false)->implicit_value(true),
+			 "Wrap H.264 output in an MPEG transport stream, for udp://, tcp:// and file output")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when signal received")
+			("encoder-control", value<std::string>(&encoder_control),
+			 "Name of a FIFO (created if necessary) from which to read encoder commands while recording, one per "
+			 "line: \"bitrate <bits/second>\", \"quality <value>\" or \"keyframe\", optionally followed by the "
+			 "number of the simulcast encoder to apply them to")
 			("initial,i", value<std::string>(&initial)->default_value("record"),
 			 "Use 'pause' to pause the recording at startup, otherwise 'record' (the default)")
 			("split", value<bool>(&split)->default_value(false)->implicit_value(true),
 			 "Create a new output file every time recording is paused and then resumed")
 			("segment", value<uint32_t>(&segment)->default_value(0),
 			 "Break the recording into files of approximately this many milliseconds")
+			("segment-quota", value<size_t>(&segment_quota)->default_value(0),
+			 "Keep the total size (in MB) of the files the output name could produce under this limit by deleting "
+			 "the oldest ones, or 0 for no limit")
 			("circular", value<size_t>(&circular)->default_value(0)->implicit_value(4),
-			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			 "Write output to a circular buffer of the given size (in MB) which is saved on exit, and also every "
+			 "time we are signalled (instead of pausing)")
+			("circular-file", value<std::string>(&circular_file),
+			 "Keep the circular buffer in this file rather than in memory, so that it can be bigger and survives "
+			 "the application crashing or restarting (though not necessarily a power cut)")
+			("circular-dump", value<unsigned int>(&circular_dump)->default_value(0),
+			 "Save only the last this many milliseconds of the circular buffer (starting from the I frame before), "
+			 "or 0 to save all of it")
+			("mp4-fragment", value<unsigned int>(&mp4_fragment)->default_value(0),
+			 "When writing an mp4 file, start a new fragment every this many milliseconds, or 0 to start one at "
+			 "every I frame")
+			("file-buffer", value<size_t>(&file_buffer)->default_value(16),
+			 "Size (in MB) of the buffer holding output while it waits to be written to file, so that slow "
+			 "storage doesn't stall the encoder")
+			("file-fsync", value<unsigned int>(&file_fsync)->default_value(0),
+			 "Sync output files to storage at most this often (in milliseconds), or 0 to leave it to the system")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("simulcast", value<std::vector<std::string>>(&simulcast)->composing(),
+			 "Run another encoder alongside the main one, with its own output. This is a comma separated list of "
+			 "key=value settings: stream (video or lores), codec, output, bitrate, quality, intra, profile, level, "
+			 "inline and mpegts, with anything not given taken from the main options. May be given more than once.")
 #if LIBAV_PRESENT
 			("libav-format", value<std::string>(&libav_format)->default_value(""),
 			 "Sets the libav encoder output format to use. "
 			 "Leave blank to try and deduce this from the filename.\n"
 			 "To list available formats, run  the \"ffmpeg -formats\" command.")
+			("libav-video-codec", value<std::string>(&libav_video_codec)->default_value("h264_v4l2m2m"),
+			 "Sets the libav video codec to use. This can be the hardware h264_v4l2m2m encoder, or a software "
+			 "encoder such as libx264 or libx265.\n"
+			 "To list available codecs, run  the \"ffmpeg -codecs\" command.")
+			("libav-preset", value<std::string>(&libav_preset)->default_value(""),
+			 "Sets the preset for software video codecs such as libx264, for example \"ultrafast\" or "
+			 "\"superfast\" to encode larger resolutions in real time.")
+			("libav-tune", value<std::string>(&libav_tune)->default_value(""),
+			 "Sets the tuning for software video codecs such as libx264, for example \"zerolatency\".")
+			("libav-threads", value<unsigned int>(&libav_threads)->default_value(0),
+			 "Number of threads for software video codecs to use, with 0 choosing automatically.")
 			("libav-audio", value<bool>(&libav_audio)->default_value(false)->implicit_value(true),
 			 "Records an audio stream together with the video.")
 			("audio-codec", value<std::string>(&audio_codec)->default_value("aac"),
@@ -93,8 +153,14 @@ struct VideoOptions : public Options
 	std::string level;
 	unsigned int intra;
 	bool inline_headers;
+	unsigned int h264_buffers;
+	std::string h264_overflow;
 	std::string codec;
 	std::string libav_format;
+	std::string libav_video_codec;
+	std::string libav_preset;
+	std::string libav_tune;
+	unsigned int libav_threads;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -104,15 +170,29 @@ struct VideoOptions : public Options
 	int32_t av_sync;
 	std::string save_pts;
 	int quality;
+	unsigned int mjpeg_threads;
+	unsigned int mjpeg_strips;
+	unsigned int mjpeg_smoothing;
 	bool listen;
+	unsigned int rtp_mtu;
+	uint32_t rtp_pacing;
+	bool mpegts;
 	bool keypress;
 	bool signal;
+	std::string encoder_control;
 	std::string initial;
 	bool pause;
 	bool split;
 	uint32_t segment;
+	size_t segment_quota;
 	size_t circular;
+	std::string circular_file;
+	unsigned int circular_dump;
+	unsigned int mp4_fragment;
+	size_t file_buffer;
+	unsigned int file_fsync;
 	uint32_t frames;
+	std::vector<std::string> simulcast;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -123,45 +203,169 @@ struct VideoOptions : public Options
 			width = 640;
 		if (height == 0)
 			height = 480;
-		if (strcasecmp(codec.c_str(), "h264") == 0)
-			codec = "h264";
-		else if (strcasecmp(codec.c_str(), "libav") == 0)
-			codec = "libav";
-		else if (strcasecmp(codec.c_str(), "yuv420") == 0)
-			codec = "yuv420";
-		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
-			codec = "mjpeg";
+		codec = parseCodec(codec);
+		if (strcasecmp(h264_overflow.c_str(), "wait") == 0)
+			h264_overflow = "wait";
+		else if (strcasecmp(h264_overflow.c_str(), "drop") == 0)
+			h264_overflow = "drop";
 		else
-			throw std::runtime_error("unrecognised codec " + codec);
+			throw std::runtime_error("unrecognised h264 overflow policy " + h264_overflow);
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
 			pause = false;
 		else
 			throw std::runtime_error("incorrect initial value " + initial);
+		forceInlineHeaders();
 		if ((pause || split || segment || circular) && !inline_headers)
 			LOG_ERROR("WARNING: consider inline headers with 'pause'/split/segment/circular");
+		if (mpegts && codec != "h264")
+			throw std::runtime_error("--mpegts only supports the h264 codec");
+		if (mpegts && circular)
+			throw std::runtime_error("--mpegts doesn't work with --circular");
+		if (outputs.size() > 1 && codec == "libav")
+			throw std::runtime_error("libav only supports one output");
+		if (outputs.size() > 1 && !circular_file.empty())
+			throw std::runtime_error("--circular-file only supports one output");
+		if (!circular_file.empty() && !circular)
+			throw std::runtime_error("--circular-file needs --circular to give its size");
 		if ((split || segment) && output.find('%') == std::string::npos)
 			LOG_ERROR("WARNING: expected % directive in output filename");
+		// Check the simulcast settings now, rather than once the camera is running.
+		for (auto const &spec : simulcast)
+		{
+			std::string stream;
+			SimulcastOptions(spec, stream);
+			if (stream == "lores" && !(lores_width && lores_height))
+				throw std::runtime_error("simulcast on the lores stream needs --lores-width and --lores-height");
+		}
 
 		return true;
 	}
+	// Receivers can join a transport stream, an RTP stream or a tcp server part way through, and they
+	// can only start decoding once they've had the SPS and PPS, so these must come with every keyframe.
+	void forceInlineHeaders()
+	{
+		if (codec != "h264" || inline_headers)
+			return;
+		for (std::string const &o : outputs)
+		{
+			if (mpegts || o.compare(0, 6, "rtp://") == 0 || (listen && o.compare(0, 6, "tcp://") == 0))
+			{
+				LOG(1, "Enabling inline headers for " << o << " so that receivers can join at any keyframe");
+				inline_headers = true;
+				return;
+			}
+		}
+	}
+	// Options for a simulcast encoder, being these options with the ones in the --simulcast string
+	// applied on top. The stream it should encode is returned too.
+	std::unique_ptr<VideoOptions> SimulcastOptions(std::string const &spec, std::string &stream) const
+	{
+		std::unique_ptr<VideoOptions> options = std::make_unique<VideoOptions>(*this);
+		// Things that only make sense once, for the main encoder.
+		options->simulcast.clear();
+		options->metadata.clear();
+		options->save_pts.clear();
+		options->encoder_control.clear();
+		options->circular_file.clear();
+		stream = "video";
+
+		std::istringstream settings(spec);
+		for (std::string setting; std::getline(settings, setting, ',');)
+		{
+			size_t equals = setting.find('=');
+			if (equals == std::string::npos)
+				throw std::runtime_error("simulcast setting " + setting + " should be key=value");
+			std::string key = setting.substr(0, equals), value = setting.substr(equals + 1);
+			if (key == "stream")
+			{
+				if (value != "video" && value != "lores")
+					throw std::runtime_error("simulcast stream must be video or lores, not " + value);
+				stream = value;
+			}
+			else if (key == "codec")
+				options->codec = parseCodec(value);
+			else if (key == "output")
+			{
+				options->output = value;
+				options->outputs = { value };
+			}
+			else if (key == "bitrate")
+				options->bitrate = std::stoul(value);
+			else if (key == "quality")
+				options->quality = std::stoi(value);
+			else if (key == "intra")
+				options->intra = std::stoul(value);
+			else if (key == "profile")
+				options->profile = value;
+			else if (key == "level")
+				options->level = value;
+			else if (key == "inline")
+				options->inline_headers = value != "0" && value != "false";
+			else if (key == "mpegts")
+				options->mpegts = value != "0" && value != "false";
+			else
+				throw std::runtime_error("unrecognised simulcast setting " + key);
+		}
+		if (options->output.empty() || options->output == output)
+			throw std::runtime_error("simulcast encoders need an output of their own");
+		// Only H.264 goes in a transport stream.
+		if (options->codec != "h264")
+			options->mpegts = false;
+		options->forceInlineHeaders();
+		return options;
+	}
 	virtual void Print() const override
 	{
 		Options::Print();
+		for (size_t i = 1; i < outputs.size(); i++)
+			std::cerr << "    output: " << outputs[i] << std::endl;
 		std::cerr << "    bitrate: " << bitrate << std::endl;
 		std::cerr << "    profile: " << profile << std::endl;
 		std::cerr << "    level:  " << level << std::endl;
 		std::cerr << "    intra: " << intra << std::endl;
 		std::cerr << "    inline: " << inline_headers << std::endl;
+		std::cerr << "    h264 buffers: " << h264_buffers << std::endl;
+		std::cerr << "    h264 overflow: " << h264_overflow << std::endl;
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    threads (for MJPEG): " << mjpeg_threads << std::endl;
+		std::cerr << "    strips (for MJPEG): " << mjpeg_strips << std::endl;
+		std::cerr << "    smoothing (for MJPEG): " << mjpeg_smoothing << std::endl;
+		std::cerr << "    rtp mtu: " << rtp_mtu << std::endl;
+		std::cerr << "    rtp pacing: " << rtp_pacing << std::endl;
+		std::cerr << "    mpegts: " << mpegts << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
+		std::cerr << "    encoder control: " << encoder_control << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
+		std::cerr << "    segment quota: " << segment_quota << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		if (!circular_file.empty())
+			std::cerr << "    circular file: " << circular_file << std::endl;
+		std::cerr << "    circular dump: " << circular_dump << std::endl;
+		std::cerr << "    mp4 fragment: " << mp4_fragment << std::endl;
+		std::cerr << "    file buffer: " << file_buffer << std::endl;
+		std::cerr << "    file fsync: " << file_fsync << std::endl;
+		for (auto const &spec : simulcast)
+			std::cerr << "    simulcast: " << spec << std::endl;
+	}
+
+private:
+	static std::string parseCodec(std::string const &codec)
+	{
+		if (strcasecmp(codec.c_str(), "h264") == 0)
+			return "h264";
+		else if (strcasecmp(codec.c_str(), "libav") == 0)
+			return "libav";
+		else if (strcasecmp(codec.c_str(), "yuv420") == 0)
+			return "yuv420";
+		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
+			return "mjpeg";
+		throw std::runtime_error("unrecognised codec " + codec);
 	}
 };
@@ -5,7 +5,10 @@
  * encoder.cpp - Video encoder class.
  */
 
+#include <algorithm>
 #include <cstring>
+#include <numeric>
+#include <sstream>
 
 #include "encoder.hpp"
 #include "h264_encoder.hpp"
@@ -16,6 +19,104 @@
 #include "libav_encoder.hpp"
 #endif
 
+Encoder::Encoder(VideoOptions const *options)
+	: options_(options), stats_last_keyframe_(0), stats_last_print_(std::chrono::steady_clock::now())
+{
+}
+
+Encoder::~Encoder()
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	if (stats_.submitted)
+		LOG(2, "Encoder stats: " << stats_.ToString());
+}
+
+Encoder::Stats Encoder::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	return stats_;
+}
+
+void Encoder::statsInput(int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	stats_.submitted++;
+	stats_pending_[timestamp_us] = std::chrono::steady_clock::now();
+	// Timestamps only go up, so the first one is the oldest.
+	if (stats_pending_.size() > STATS_MAX_PENDING)
+		stats_pending_.erase(stats_pending_.begin());
+}
+
+void Encoder::statsDropped(int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	stats_.dropped++;
+	stats_pending_.erase(timestamp_us);
+}
+
+void Encoder::statsOutput(int64_t timestamp_us, size_t bytes, bool keyframe)
+{
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	Stats &s = stats_;
+
+	// Output needn't come out in the order it went in, so find this frame by its timestamp.
+	auto it = stats_pending_.find(timestamp_us);
+	if (it != stats_pending_.end())
+	{
+		double latency_ms = std::chrono::duration<double, std::milli>(now - it->second).count();
+		stats_pending_.erase(it);
+		unsigned int bucket = std::upper_bound(Stats::LATENCY_LIMITS_MS.begin(), Stats::LATENCY_LIMITS_MS.end(),
+											   latency_ms) - Stats::LATENCY_LIMITS_MS.begin();
+		s.latency_histogram[bucket]++;
+		s.total_latency_ms += latency_ms;
+		s.max_latency_ms = std::max(s.max_latency_ms, latency_ms);
+	}
+
+	s.completed++;
+	s.total_bytes += bytes;
+	s.min_bytes = s.completed == 1 ? bytes : std::min(s.min_bytes, bytes);
+	s.max_bytes = std::max(s.max_bytes, bytes);
+	if (keyframe)
+	{
+		if (s.keyframes)
+		{
+			uint64_t interval = s.completed - stats_last_keyframe_;
+			s.total_keyframe_interval += interval;
+			s.max_keyframe_interval = std::max(s.max_keyframe_interval, interval);
+		}
+		s.keyframes++;
+		stats_last_keyframe_ = s.completed;
+	}
+
+	if (now - stats_last_print_ >= STATS_INTERVAL)
+	{
+		LOG(2, "Encoder stats: " << s.ToString());
+		stats_last_print_ = now;
+	}
+}
+
+std::string Encoder::Stats::ToString() const
+{
+	std::stringstream ss;
+	ss << "submitted " << submitted << " completed " << completed << " dropped " << dropped << " in flight "
+	   << InFlight();
+	if (completed)
+	{
+		ss << ", bytes per frame " << total_bytes / completed << " (" << min_bytes << " to " << max_bytes << ")";
+		uint64_t latencies = std::accumulate(latency_histogram.begin(), latency_histogram.end(), (uint64_t)0);
+		ss << ", latency " << total_latency_ms / std::max(latencies, (uint64_t)1) << "ms (max " << max_latency_ms
+		   << "ms) [";
+		for (unsigned int i = 0; i < LATENCY_LIMITS_MS.size(); i++)
+			ss << "<" << LATENCY_LIMITS_MS[i] << "ms:" << latency_histogram[i] << " ";
+		ss << "more:" << latency_histogram.back() << "]";
+	}
+	if (keyframes > 1)
+		ss << ", keyframe interval " << (double)total_keyframe_interval / (keyframes - 1) << " (max "
+		   << max_keyframe_interval << ")";
+	return ss.str();
+}
+
 Encoder *Encoder::Create(VideoOptions const *options, const StreamInfo &info)
 {
 	if (strcasecmp(options->codec.c_str(), "yuv420") == 0)
@@ -7,34 +7,100 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <string>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
+typedef std::function<void(int)> QualityReadyCallback;
 
 class Encoder
 {
 public:
 	static Encoder *Create(VideoOptions const *options, StreamInfo const &info);
 
-	Encoder(VideoOptions const *options) : options_(options) {}
-	virtual ~Encoder() {}
+	// Counts of what the encoder has been doing, available at any time while it runs.
+	struct Stats
+	{
+		// Upper limits of the latency histogram buckets, in ms. The last bucket is everything bigger.
+		static constexpr std::array<unsigned int, 7> LATENCY_LIMITS_MS = { 5, 10, 20, 50, 100, 200, 500 };
+
+		uint64_t submitted = 0;
+		uint64_t completed = 0;
+		uint64_t dropped = 0;
+		// Time from each frame being submitted until its encoded output appears.
+		std::array<uint64_t, LATENCY_LIMITS_MS.size() + 1> latency_histogram = {};
+		double total_latency_ms = 0;
+		double max_latency_ms = 0;
+		uint64_t total_bytes = 0;
+		size_t min_bytes = 0;
+		size_t max_bytes = 0;
+		// Number of frames from one keyframe to the next.
+		uint64_t keyframes = 0;
+		uint64_t total_keyframe_interval = 0;
+		uint64_t max_keyframe_interval = 0;
+
+		// Frames submitted but not yet output (or dropped).
+		uint64_t InFlight() const { return submitted - completed - dropped; }
+		std::string ToString() const;
+	};
+
+	Encoder(VideoOptions const *options);
+	virtual ~Encoder();
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. The callback
+	// is passed the mem pointer that was given to EncodeBuffer, and buffers may be
+	// returned in any order.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// Encoders with a quality setting (currently only MJPEG) may report the value used
+	// for each frame, immediately before the output ready callback for that frame.
+	void SetQualityReadyCallback(QualityReadyCallback callback) { quality_ready_callback_ = callback; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// These change the encoder's behaviour while it's running, and return false if the encoder
+	// doesn't support them. The bitrate is in bits per second, and setting a quality turns off
+	// any rate control.
+	virtual bool SetBitrate(unsigned int bitrate) { return false; }
+	virtual bool SetQuality(int quality) { return false; }
+	// Ask for the next frame to be a keyframe. Encoders that only produce keyframes may ignore this.
+	virtual bool ForceKeyframe() { return false; }
+	Stats GetStats() const;
 
 protected:
+	// Encoders call these as frames arrive, get dropped, and come out, to keep the stats.
+	void statsInput(int64_t timestamp_us);
+	void statsDropped(int64_t timestamp_us);
+	void statsOutput(int64_t timestamp_us, size_t bytes, bool keyframe);
+
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
+	QualityReadyCallback quality_ready_callback_;
 	VideoOptions const *options_;
+
+private:
+	// How often the stats get logged (at verbosity level 2).
+	static constexpr std::chrono::seconds STATS_INTERVAL = std::chrono::seconds(5);
+	// Most frames we remember the arrival time of. Frames that an encoder skips without telling
+	// us would otherwise stay here forever.
+	static constexpr size_t STATS_MAX_PENDING = 64;
+
+	mutable std::mutex stats_mutex_;
+	Stats stats_;
+	// Frames still in the encoder, by timestamp, with the time they arrived. Encoders with B
+	// frames output them in a different order, so we can't assume they come out in sequence.
+	std::map<int64_t, std::chrono::steady_clock::time_point> stats_pending_;
+	uint64_t stats_last_keyframe_;
+	std::chrono::steady_clock::time_point stats_last_print_;
 };
@@ -7,8 +7,10 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <linux/videodev2.h>
 
@@ -39,7 +41,8 @@ static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
 }
 
 H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), abortPoll_(false), abortOutput_(false)
+	: Encoder(options), abortOutput_(false), drop_(options->h264_overflow == "drop"), frames_waited_(0),
+	  frames_dropped_(0)
 {
 	// First open the encoder device. Maybe we should double-check its "caps".
 
@@ -144,12 +147,14 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	// m-mapped.
 
 	v4l2_requestbuffers reqbufs = {};
-	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.count = options->h264_buffers;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_DMABUF;
-	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0 || reqbufs.count == 0)
 		throw std::runtime_error("request for output buffers failed");
 	LOG(2, "Got " << reqbufs.count << " output buffers");
+	num_output_buffers_ = reqbufs.count;
+	input_mem_.resize(num_output_buffers_, nullptr);
 
 	// We have to maintain a list of the buffers we can use when our caller gives
 	// us another frame to encode.
@@ -197,16 +202,31 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		throw std::runtime_error("failed to start capture streaming");
 	LOG(2, "Codec streaming started");
 
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_fd_ < 0)
+		throw std::runtime_error("failed to create H264 encoder eventfd");
+
 	output_thread_ = std::thread(&H264Encoder::outputThread, this);
 	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
 }
 
 H264Encoder::~H264Encoder()
 {
-	abortPoll_ = true;
+	uint64_t abort = 1;
+	if (write(abort_fd_, &abort, sizeof(abort)) < 0)
+		LOG(1, "Failed to signal H264Encoder poll thread");
 	poll_thread_.join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
+	close(abort_fd_);
+
+	if (frames_dropped_)
+		LOG(1, "H264Encoder dropped " << frames_dropped_ << " frames because no input buffers were free");
+	LOG(2, "H264Encoder waited for an input buffer " << frames_waited_ << " times");
 
 	// Turn off streaming on both the output and capture queues, and "free" the
 	// buffers that we requested. The capture ones need to be "munmapped" first.
@@ -241,15 +261,36 @@ H264Encoder::~H264Encoder()
 
 void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	statsInput(timestamp_us);
 	int index;
 	{
 		// We need to find an available output buffer (input to the codec) to
-		// "wrap" the DMABUF.
-		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+		// "wrap" the DMABUF. If there isn't one, the codec must have stalled, in
+		// which case we either drop the frame, or wait a while for a buffer.
+		std::unique_lock<std::mutex> lock(input_buffers_available_mutex_);
 		if (input_buffers_available_.empty())
-			throw std::runtime_error("no buffers available to queue codec input");
+		{
+			bool available = false;
+			if (!drop_)
+			{
+				frames_waited_++;
+				available = input_buffers_available_cond_.wait_for(lock, INPUT_WAIT_TIMEOUT, [this] {
+					return !input_buffers_available_.empty();
+				});
+			}
+			if (!available)
+			{
+				frames_dropped_++;
+				lock.unlock();
+				statsDropped(timestamp_us);
+				LOG(2, "H264Encoder dropping frame, no input buffers free");
+				input_done_callback_(mem);
+				return;
+			}
+		}
 		index = input_buffers_available_.front();
 		input_buffers_available_.pop();
+		input_mem_[index] = mem;
 	}
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -268,24 +309,51 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::SetBitrate(unsigned int bitrate)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264Encoder: failed to set bitrate " << bitrate);
+		return false;
+	}
+	LOG(2, "H264Encoder: bitrate now " << bitrate);
+	return true;
+}
+
+bool H264Encoder::ForceKeyframe()
+{
+	// This applies to the next frame that we queue to the codec.
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264Encoder: failed to force keyframe");
+		return false;
+	}
+	return true;
+}
+
 void H264Encoder::pollThread()
 {
+	bool abort = false;
 	while (true)
 	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
-		{
-			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
-				break;
-		}
+		// Once we've been told to stop, we only carry on until all our buffers are back.
+		pollfd p[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+		int ret = poll(p, abort ? 1 : 2, -1);
 		if (ret == -1)
 		{
 			if (errno == EINTR)
 				continue;
 			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
 		}
-		if (p.revents & POLLIN)
+		if (p[1].revents & POLLIN)
+			abort = true;
+		if (p[0].revents & POLLIN)
 		{
 			v4l2_buffer buf = {};
 			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -298,11 +366,14 @@ void H264Encoder::pollThread()
 			{
 				// Return this to the caller, first noting that this buffer, identified
 				// by its index, is available for queueing up another frame.
+				void *mem;
 				{
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
+					mem = input_mem_[buf.index];
 				}
-				input_done_callback_(nullptr);
+				input_buffers_available_cond_.notify_one();
+				input_done_callback_(mem);
 			}
 
 			buf = {};
@@ -324,11 +395,22 @@ void H264Encoder::pollThread()
 									buf.index,
 									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
 									timestamp_us };
-				std::lock_guard<std::mutex> lock(output_mutex_);
-				output_queue_.push(item);
+				{
+					std::lock_guard<std::mutex> lock(output_mutex_);
+					output_queue_.push(item);
+				}
 				output_cond_var_.notify_one();
 			}
 		}
+
+		// Check this only after dequeueing, as the last buffers may have just come back, and
+		// nothing else is going to wake us up.
+		if (abort)
+		{
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			if (input_buffers_available_.size() == num_output_buffers_)
+				break;
+		}
 	}
 }
 
@@ -339,25 +421,16 @@ void H264Encoder::outputThread()
 	{
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// Must check the abort first, to allow items in the output
-				// queue to have a callback.
-				if (abortOutput_ && output_queue_.empty())
-					return;
-
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-			}
+			// Items still in the output queue must have their callbacks before we
+			// stop, even once we've been told to abort.
+			output_cond_var_.wait(lock, [this] { return abortOutput_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
 		}
 
+		statsOutput(item.timestamp_us, item.bytes_used, item.keyframe);
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
 		v4l2_buffer buf = {};
 		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -7,10 +7,12 @@
 
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -21,15 +23,20 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool SetBitrate(unsigned int bitrate) override;
+	bool ForceKeyframe() override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
-	// (we always want to be able to queue them when they arrive). Make loads
-	// of capture buffers, as this is our buffering mechanism in case of delays
-	// dealing with the output bitstream.
-	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+	// (we always want to be able to queue them when they arrive), which is what the
+	// h264-buffers option should be set to. Make loads of capture buffers, as this
+	// is our buffering mechanism in case of delays dealing with the output bitstream.
 	static constexpr int NUM_CAPTURE_BUFFERS = 12;
 
+	// If the encoder stalls and we run out of output buffers, this is the longest we
+	// wait for one before dropping the frame anyway.
+	static constexpr std::chrono::milliseconds INPUT_WAIT_TIMEOUT = std::chrono::milliseconds(1000);
+
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
 	// * receive encoded buffers, which we pass to the application.
@@ -40,9 +47,10 @@ private:
 	// re-use.
 	void outputThread();
 
-	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	// Written to wake the poll thread when it's time to stop.
+	int abort_fd_;
 	struct BufferDescription
 	{
 		void *mem;
@@ -52,7 +60,15 @@ private:
 	int num_capture_buffers_;
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
+	std::condition_variable input_buffers_available_cond_;
 	std::queue<int> input_buffers_available_;
+	unsigned int num_output_buffers_;
+	// The caller's buffer currently queued in each of our output buffers, so that we can say
+	// which one is done.
+	std::vector<void *> input_mem_;
+	bool drop_;
+	unsigned int frames_waited_;
+	unsigned int frames_dropped_;
 	struct OutputItem
 	{
 		void *mem;
@@ -14,29 +14,60 @@
 #include <linux/videodev2.h>
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <set>
 
 #include "libav_encoder.hpp"
 
 void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const &info)
 {
-	const std::string codec_name("h264_v4l2m2m");
+	const std::string &codec_name = options->libav_video_codec;
 
 	const AVCodec *codec = avcodec_find_encoder_by_name(codec_name.c_str());
 	if (!codec)
 		throw std::runtime_error("libav: cannot find video encoder " + codec_name);
 
+	// Use DMABUFs if the codec can take them, otherwise we need a codec that accepts plain YUV420.
+	// Some codecs, including the v4l2m2m ones, don't list their formats at all, and those we always
+	// gave DMABUFs.
+	bool yuv420p = false;
+	if (!codec->pix_fmts || (codec->wrapper_name && !strcmp(codec->wrapper_name, "v4l2m2m")))
+		drm_prime_ = true;
+	for (const AVPixelFormat *fmt = codec->pix_fmts; fmt && *fmt != AV_PIX_FMT_NONE; fmt++)
+	{
+		drm_prime_ |= *fmt == AV_PIX_FMT_DRM_PRIME;
+		yuv420p |= *fmt == AV_PIX_FMT_YUV420P;
+	}
+	if (!drm_prime_ && !yuv420p)
+		throw std::runtime_error("libav: video encoder " + codec_name + " does not accept YUV420 frames");
+	LOG(2, "libav: using " << (drm_prime_ ? "DMABUF" : "YUV420") << " input for video encoder " << codec_name);
+
 	codec_ctx_[Video] = avcodec_alloc_context3(codec);
 	if (!codec_ctx_[Video])
 		throw std::runtime_error("libav: Cannot allocate video context");
 
+	// libx264 reconfigures itself when it sees the bitrate in the context change.
+	bitrate_reconfigurable_ = codec_name == "libx264";
+
 	codec_ctx_[Video]->width = info.width;
 	codec_ctx_[Video]->height = info.height;
 	// usec timebase
 	codec_ctx_[Video]->time_base = { 1, 1000 * 1000 };
 	codec_ctx_[Video]->framerate = { (int)(options->framerate.value_or(DEFAULT_FRAMERATE) * 1000), 1000 };
-	codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_DRM_PRIME;
-	codec_ctx_[Video]->sw_pix_fmt = AV_PIX_FMT_YUV420P;
+	if (drm_prime_)
+	{
+		codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_DRM_PRIME;
+		codec_ctx_[Video]->sw_pix_fmt = AV_PIX_FMT_YUV420P;
+		drm_desc_pool_ = av_buffer_pool_init(sizeof(AVDRMFrameDescriptor), nullptr);
+		if (!drm_desc_pool_)
+			throw std::runtime_error("libav: cannot allocate DRM frame descriptor pool");
+	}
+	else
+	{
+		codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_YUV420P;
+		codec_ctx_[Video]->thread_count = options->libav_threads;
+	}
 
 	if (info.colour_space)
 	{
@@ -84,7 +115,7 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (options->bitrate)
 		codec_ctx_[Video]->bit_rate = options->bitrate;
 
-	if (!options->profile.empty())
+	if (!options->profile.empty() && codec->id == AV_CODEC_ID_H264)
 	{
 		static const std::map<std::string, int> profile_map = {
 			{ "baseline", FF_PROFILE_H264_BASELINE },
@@ -99,7 +130,8 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 		codec_ctx_[Video]->profile = it->second;
 	}
 
-	codec_ctx_[Video]->level = options->level.empty() ? FF_LEVEL_UNKNOWN : std::stof(options->level) * 10;
+	if (codec->id == AV_CODEC_ID_H264)
+		codec_ctx_[Video]->level = options->level.empty() ? FF_LEVEL_UNKNOWN : std::stof(options->level) * 10;
 
 	if (options->intra)
 		codec_ctx_[Video]->gop_size = options->intra;
@@ -114,7 +146,18 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (out_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
 		codec_ctx_[Video]->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-	int ret = avcodec_open2(codec_ctx_[Video], codec, nullptr);
+	// Software codecs such as libx264 and libx265 have their own preset and tune options.
+	AVDictionary *codec_opts = nullptr;
+	if (!options->libav_preset.empty())
+		av_dict_set(&codec_opts, "preset", options->libav_preset.c_str(), 0);
+	if (!options->libav_tune.empty())
+		av_dict_set(&codec_opts, "tune", options->libav_tune.c_str(), 0);
+
+	int ret = avcodec_open2(codec_ctx_[Video], codec, &codec_opts);
+	// Anything left in the dictionary wasn't recognised by the codec.
+	for (AVDictionaryEntry *e = nullptr; (e = av_dict_get(codec_opts, "", e, AV_DICT_IGNORE_SUFFIX));)
+		LOG(1, "libav: video encoder " << codec_name << " ignored option " << e->key << "=" << e->value);
+	av_dict_free(&codec_opts);
 	if (ret < 0)
 		throw std::runtime_error("libav: unable to open video codec: " + std::to_string(ret));
 
@@ -212,8 +255,9 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 }
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false),
-	  video_start_ts_(0), audio_samples_(0), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr)
+	: Encoder(options), drm_prime_(false), output_ready_(false), abort_video_(false), abort_audio_(false),
+	  video_start_ts_(0), audio_samples_(0), bitrate_reconfigurable_(false), new_bitrate_(0), force_keyframe_(false),
+	  frames_allocated_(0), drm_desc_pool_(nullptr), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr)
 {
 	avdevice_register_all();
 
@@ -252,6 +296,12 @@ LibAvEncoder::~LibAvEncoder()
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
+	for (AVFrame *frame : free_frames_)
+		av_frame_free(&frame);
+	// The pool goes away once the last descriptor the codec still holds (if any) is released.
+	av_buffer_pool_uninit(&drm_desc_pool_);
+	LOG(2, "libav: allocated " << frames_allocated_ << " video frames");
+
 	if (options_->libav_audio)
 	{
 		avformat_free_context(in_fmt_ctx_);
@@ -264,23 +314,62 @@ LibAvEncoder::~LibAvEncoder()
 
 void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	AVFrame *frame = av_frame_alloc();
-	if (!frame)
-		throw std::runtime_error("libav: could not allocate AVFrame");
+	statsInput(timestamp_us);
+	AVFrame *frame = getFrame();
 
 	if (!video_start_ts_)
 		video_start_ts_ = timestamp_us;
 
-	frame->format = AV_PIX_FMT_DRM_PRIME;
 	frame->width = info.width;
 	frame->height = info.height;
-	frame->linesize[0] = info.stride;
 	frame->pts = timestamp_us - video_start_ts_ + (options_->av_sync < 0 ? -options_->av_sync : 0);
+	if (force_keyframe_.exchange(false))
+		frame->pict_type = AV_PICTURE_TYPE_I;
+
+	// This is how we know which buffer to return once the codec has the frame.
+	frame->opaque = mem;
+	if (drm_prime_)
+		wrapDrmFrame(frame, fd, size, info);
+	else
+		wrapYuvFrame(frame, mem, size, info);
 
-	frame->buf[0] = av_buffer_alloc(sizeof(AVDRMFrameDescriptor));
+	std::scoped_lock<std::mutex> lock(video_mutex_);
+	frame_queue_.push(frame);
+	video_cv_.notify_all();
+}
+
+AVFrame *LibAvEncoder::getFrame()
+{
+	{
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		if (!free_frames_.empty())
+		{
+			AVFrame *frame = free_frames_.back();
+			free_frames_.pop_back();
+			return frame;
+		}
+	}
+
+	AVFrame *frame = av_frame_alloc();
+	if (!frame)
+		throw std::runtime_error("libav: could not allocate AVFrame");
+	frames_allocated_++;
+	return frame;
+}
+
+void LibAvEncoder::wrapDrmFrame(AVFrame *frame, int fd, size_t size, StreamInfo const &info)
+{
+	frame->format = AV_PIX_FMT_DRM_PRIME;
+	frame->linesize[0] = info.stride;
+
+	frame->buf[0] = av_buffer_pool_get(drm_desc_pool_);
+	if (!frame->buf[0])
+		throw std::runtime_error("libav: could not allocate DRM frame descriptor");
 	frame->data[0] = frame->buf[0]->data;
 
+	// Recycled descriptors still hold whatever the last frame put in them.
 	AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+	memset(desc, 0, sizeof(*desc));
 	desc->nb_objects = 1;
 	desc->objects[0].fd = fd;
 	desc->objects[0].size = size;
@@ -298,10 +387,49 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	desc->layers[0].planes[2].object_index = 0;
 	desc->layers[0].planes[2].offset = info.stride * info.height * 5 / 4;
 	desc->layers[0].planes[2].pitch = info.stride >> 1;
+}
 
-	std::scoped_lock<std::mutex> lock(video_mutex_);
-	frame_queue_.push(frame);
-	video_cv_.notify_all();
+void LibAvEncoder::wrapYuvFrame(AVFrame *frame, void *mem, size_t size, StreamInfo const &info)
+{
+	// The frame points straight at the camera buffer, which is returned (by the buffer's free
+	// callback) only when the codec and the frame have both dropped their references to it.
+	frame->format = AV_PIX_FMT_YUV420P;
+	frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseYuvBuffer, this, 0);
+	if (!frame->buf[0])
+		throw std::runtime_error("libav: could not wrap YUV420 buffer");
+
+	uint8_t *y = (uint8_t *)mem;
+	uint8_t *u = y + info.stride * info.height;
+	uint8_t *v = u + (info.stride >> 1) * (info.height >> 1);
+	frame->data[0] = y;
+	frame->data[1] = u;
+	frame->data[2] = v;
+	frame->linesize[0] = info.stride;
+	frame->linesize[1] = info.stride >> 1;
+	frame->linesize[2] = info.stride >> 1;
+}
+
+void LibAvEncoder::releaseYuvBuffer(void *opaque, uint8_t *data)
+{
+	LibAvEncoder *encoder = static_cast<LibAvEncoder *>(opaque);
+	encoder->input_done_callback_(data);
+}
+
+bool LibAvEncoder::SetBitrate(unsigned int bitrate)
+{
+	if (!bitrate_reconfigurable_)
+	{
+		LOG(1, "libav: video encoder " << options_->libav_video_codec << " can't change bitrate while running");
+		return false;
+	}
+	new_bitrate_ = bitrate;
+	return true;
+}
+
+bool LibAvEncoder::ForceKeyframe()
+{
+	force_keyframe_ = true;
+	return true;
 }
 
 void LibAvEncoder::initOutput()
@@ -372,6 +500,11 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 			output_ready_ = true;
 		}
 
+		// Video packets can be matched back to the frame timestamps that went in.
+		if (stream_id == Video)
+			statsOutput(pkt->pts + video_start_ts_ - (options_->av_sync < 0 ? -options_->av_sync : 0), pkt->size,
+						pkt->flags & AV_PKT_FLAG_KEY);
+
 		pkt->stream_index = stream_id;
 		pkt->pos = -1;
 		pkt->duration = 0;
@@ -417,14 +550,31 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		// Encoders that can change bitrate on the fly (see SetBitrate) notice the context value changing.
+		unsigned int bitrate = new_bitrate_.exchange(0);
+		if (bitrate)
+		{
+			codec_ctx_[Video]->bit_rate = bitrate;
+			LOG(2, "libav: video bitrate now " << bitrate);
+		}
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
-		input_done_callback_(nullptr);
+		// DMABUFs are finished with once the hardware codec has them, but mapped buffers are
+		// returned when the codec is done with the frame (and we've dropped our reference below).
+		if (drm_prime_)
+			input_done_callback_(frame->opaque);
 
 		encode(pkt, Video);
-		av_frame_free(&frame);
+
+		// The codec has its own reference to anything it still needs.
+		av_frame_unref(frame);
+		{
+			std::scoped_lock<std::mutex> lock(video_mutex_);
+			free_frames_.push_back(frame);
+		}
 	}
 
 done:
@@ -459,6 +609,24 @@ void LibAvEncoder::audioThread()
 	AVPacket *out_pkt = av_packet_alloc();
 	AVFrame *in_frame = av_frame_alloc();
 
+	// The converted samples go into a buffer that only grows when a bigger input packet arrives.
+	// Encoded frames reuse the same AVFrame, with sample buffers from a pool that they return to
+	// when the codec releases them.
+	const int channels = codec_ctx_[AudioOut]->channels;
+	const int frame_size = codec_ctx_[AudioOut]->frame_size;
+	uint8_t **samples = nullptr;
+	int samples_size = 0;
+	unsigned int samples_allocated = 0;
+	// The pool doesn't tell us how big it grew, but each buffer it makes has its own memory.
+	std::set<uint8_t const *> out_buffers;
+	int out_buffer_size = av_samples_get_buffer_size(nullptr, channels, frame_size, required_fmt, 0);
+	if (out_buffer_size < 0)
+		throw std::runtime_error("libav: cannot compute audio frame size");
+	AVBufferPool *out_pool = av_buffer_pool_init(out_buffer_size, nullptr);
+	AVFrame *out_frame = av_frame_alloc();
+	if (!out_pool || !out_frame)
+		throw std::runtime_error("libav: cannot allocate audio output frames");
+
 	while (!abort_audio_)
 	{
 		int ret;
@@ -477,15 +645,22 @@ void LibAvEncoder::audioThread()
 			throw std::runtime_error("libav: error getting decoded audio in frame");
 
 		// Audio Resample/Conversion
-		uint8_t **samples = nullptr;
-		ret = av_samples_alloc_array_and_samples(&samples, NULL, codec_ctx_[AudioOut]->channels,
-												 codec_ctx_[AudioOut]->frame_size, required_fmt, 0);
-		if (ret < 0)
-			throw std::runtime_error("libav: failed to alloc sample array");
+		int max_samples = std::max(swr_get_out_samples(conv, in_frame->nb_samples), frame_size);
+		if (max_samples > samples_size)
+		{
+			if (samples)
+				av_freep(&samples[0]);
+			av_freep(&samples);
+			ret = av_samples_alloc_array_and_samples(&samples, NULL, channels, max_samples, required_fmt, 0);
+			if (ret < 0)
+				throw std::runtime_error("libav: failed to alloc sample array");
+			samples_size = max_samples;
+			samples_allocated++;
+		}
 
-		ret = swr_convert(conv, samples, codec_ctx_[AudioOut]->frame_size,
-						  (const uint8_t **)in_frame->extended_data, in_frame->nb_samples);
-		if (ret < 0)
+		int converted = swr_convert(conv, samples, samples_size, (const uint8_t **)in_frame->extended_data,
+									in_frame->nb_samples);
+		if (converted < 0)
 			throw std::runtime_error("libav: swr_convert failed");
 
 		// Pre-record some audio before the encoded video frame is available.
@@ -498,19 +673,18 @@ void LibAvEncoder::audioThread()
 			// Number of pre-record samples rounded to the frame size.
 			unsigned int ps = !r ? ns : ns + codec_ctx_[AudioOut]->frame_size - r;
 			// FIFO size with samples from the next frame added.
-			unsigned int fs = av_audio_fifo_size(fifo) + in_frame->nb_samples;
+			unsigned int fs = av_audio_fifo_size(fifo) + converted;
 			if (fs > ps)
 				av_audio_fifo_drain(fifo, fs - ps);
 		}
 
-		if (av_audio_fifo_space(fifo) < in_frame->nb_samples)
+		if (av_audio_fifo_space(fifo) < converted)
 		{
 			LOG(1, "libav: Draining audio fifo, configure a larger size");
-			av_audio_fifo_drain(fifo, in_frame->nb_samples);
+			av_audio_fifo_drain(fifo, converted);
 		}
 
-		av_audio_fifo_write(fifo, (void **)samples, in_frame->nb_samples);
-		av_freep(&samples[0]);
+		av_audio_fifo_write(fifo, (void **)samples, converted);
 
 		av_frame_unref(in_frame);
 		av_packet_unref(in_pkt);
@@ -520,17 +694,22 @@ void LibAvEncoder::audioThread()
 			continue;
 
 		// Audio Out
-		while (av_audio_fifo_size(fifo) >= codec_ctx_[AudioOut]->frame_size)
+		while (av_audio_fifo_size(fifo) >= frame_size)
 		{
-			AVFrame *out_frame = av_frame_alloc();
-			out_frame->nb_samples = codec_ctx_[AudioOut]->frame_size;
-			out_frame->channels = codec_ctx_[AudioOut]->channels;
-			out_frame->channel_layout = av_get_default_channel_layout(codec_ctx_[AudioOut]->channels);
+			out_frame->nb_samples = frame_size;
+			out_frame->channels = channels;
+			out_frame->channel_layout = av_get_default_channel_layout(channels);
 			out_frame->format = required_fmt;
 			out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
 
-			av_frame_get_buffer(out_frame, 0);
-			av_audio_fifo_read(fifo, (void **)out_frame->data, codec_ctx_[AudioOut]->frame_size);
+			out_frame->buf[0] = av_buffer_pool_get(out_pool);
+			if (!out_frame->buf[0])
+				throw std::runtime_error("libav: cannot get audio frame buffer");
+			out_buffers.insert(out_frame->buf[0]->data);
+			av_samples_fill_arrays(out_frame->data, out_frame->linesize, out_frame->buf[0]->data, channels,
+								   frame_size, required_fmt, 0);
+			out_frame->extended_data = out_frame->data;
+			av_audio_fifo_read(fifo, (void **)out_frame->data, frame_size);
 
 			AVRational num = { 1, out_frame->sample_rate };
 			int64_t ts = av_rescale_q(audio_samples_, num, codec_ctx_[AudioOut]->time_base);
@@ -543,7 +722,7 @@ void LibAvEncoder::audioThread()
 				throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 			encode(out_pkt, AudioOut);
-			av_frame_free(&out_frame);
+			av_frame_unref(out_frame);
 		}
 	}
 
@@ -557,4 +736,11 @@ void LibAvEncoder::audioThread()
 	av_packet_free(&in_pkt);
 	av_packet_free(&out_pkt);
 	av_frame_free(&in_frame);
+	av_frame_free(&out_frame);
+	if (samples)
+		av_freep(&samples[0]);
+	av_freep(&samples);
+	av_buffer_pool_uninit(&out_pool);
+	LOG(2, "libav: allocated audio sample buffers " << samples_allocated << " times");
+	LOG(2, "libav: allocated " << out_buffers.size() << " audio frame buffers");
 }
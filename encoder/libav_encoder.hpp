@@ -12,6 +12,7 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 extern "C"
 {
@@ -35,9 +36,15 @@ public:
 	~LibAvEncoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool SetBitrate(unsigned int bitrate) override;
+	bool ForceKeyframe() override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
+	AVFrame *getFrame();
+	void wrapDrmFrame(AVFrame *frame, int fd, size_t size, StreamInfo const &info);
+	void wrapYuvFrame(AVFrame *frame, void *mem, size_t size, StreamInfo const &info);
+	static void releaseYuvBuffer(void *opaque, uint8_t *data);
 	void initAudioInCodec(VideoOptions const *options, StreamInfo const &info);
 	void initAudioOutCodec(VideoOptions const *options, StreamInfo const &info);
 
@@ -48,13 +55,26 @@ private:
 	void videoThread();
 	void audioThread();
 
+	// Hardware codecs take DMABUFs (as DRM PRIME frames), software ones the mapped YUV420 planes.
+	bool drm_prime_;
 	std::atomic<bool> output_ready_;
 	bool abort_video_;
 	bool abort_audio_;
 	uint64_t video_start_ts_;
 	uint64_t audio_samples_;
+	// Changes requested while running, picked up by the next frame to be encoded. The
+	// video thread owns the codec context, so only it applies the new bitrate. Most codecs
+	// ignore bitrate changes once they're open, so we only accept them for the ones that don't.
+	bool bitrate_reconfigurable_;
+	std::atomic<unsigned int> new_bitrate_;
+	std::atomic<bool> force_keyframe_;
 
 	std::queue<AVFrame *> frame_queue_;
+	// Frames are recycled once the codec has taken its own reference to them, and the DRM frame
+	// descriptors come from a pool, so we stop allocating these once encoding is under way.
+	std::vector<AVFrame *> free_frames_;
+	unsigned int frames_allocated_;
+	AVBufferPool *drm_desc_pool_;
 	std::mutex video_mutex_;
 	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
@@ -6,89 +6,138 @@
  */
 
 #include <chrono>
+#include <cmath>
 #include <iostream>
 
 #include <jpeglib.h>
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+// Rate control never goes outside this quality range. Right at the top end the frames get
+// huge, and right at the bottom they're unwatchable anyway.
+static constexpr int MIN_RC_QUALITY = 5;
+static constexpr int MAX_RC_QUALITY = 95;
+
+// libjpeg turns the quality into a percentage scale factor for the quantisation tables,
+// and it's that which the compressed size roughly follows.
+static double quality_to_scale(int quality)
+{
+	return quality < 50 ? 5000.0 / quality : 200.0 - 2 * quality;
+}
+
+static int scale_to_quality(double scale)
+{
+	return std::lround(scale > 100 ? 5000.0 / scale : (200.0 - scale) / 2);
+}
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), bitrate_(options->bitrate),
+	  quality_(options->quality),
+	  rc_scale_(quality_to_scale(std::clamp(options->quality, 1, 100))), rc_bits_(0), rc_frame_time_(0),
+	  rc_last_timestamp_(-1)
 {
+	unsigned int num_threads = options->mjpeg_threads;
+	if (num_threads == 0)
+		num_threads = std::max(std::thread::hardware_concurrency(), 1u);
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_thread_.emplace_back(&MjpegEncoder::encodeThread, this, i);
+	LOG(2, "Opened MjpegEncoder with " << num_threads << " threads");
+	if (options->bitrate)
+		LOG(2, "MjpegEncoder rate control to " << options->bitrate << " bits/second");
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+	}
+	encode_cond_var_.notify_all();
+	for (auto &thread : encode_thread_)
+		thread.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
 	LOG(2, "MjpegEncoder closed");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	statsInput(timestamp_us);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	unsigned int num_strips = JpegStrips(info.width, info.height, options_->mjpeg_strips).Count();
+	// All the strips of a frame must use the same quality, or they couldn't share the headers.
+	int quality = quality_;
+	uint64_t index;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		index = index_++;
+		if (num_strips > 1)
+		{
+			// The frame must be waiting for its strips before any of them can finish.
+			std::lock_guard<std::mutex> strip_lock(strip_mutex_);
+			strip_frames_[index] = { std::vector<JpegBuffer>(num_strips), num_strips };
+		}
+		for (unsigned int strip = 0; strip < num_strips; strip++)
+		{
+			EncodeItem item = { mem, info, timestamp_us, index, quality, num_strips, strip, start_time };
+			encode_queue_.push(item);
+		}
+	}
+	if (num_strips > 1)
+		encode_cond_var_.notify_all();
+	else
+		encode_cond_var_.notify_one();
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+bool MjpegEncoder::SetBitrate(unsigned int bitrate)
 {
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
-
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
-	{
-		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+	bitrate_ = bitrate;
+	LOG(2, "MjpegEncoder rate control to " << bitrate << " bits/second");
+	return true;
+}
 
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
-	}
+bool MjpegEncoder::SetQuality(int quality)
+{
+	bitrate_ = 0;
+	quality_ = std::clamp(quality, 1, 100);
+	LOG(2, "MjpegEncoder quality now " << quality_);
+	return true;
+}
 
-	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+JpegBuffer MjpegEncoder::getBuffer()
+{
+	std::lock_guard<std::mutex> lock(buffer_mutex_);
+	if (buffer_pool_.empty())
+		return JpegBuffer();
+	JpegBuffer buffer = std::move(buffer_pool_.back());
+	buffer_pool_.pop_back();
+	return buffer;
+}
+
+void MjpegEncoder::returnBuffer(JpegBuffer &&buffer)
+{
+	std::lock_guard<std::mutex> lock(buffer_mutex_);
+	buffer_pool_.push_back(std::move(buffer));
+}
+
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, JpegBuffer &buffer)
+{
+	uint8_t const *mem = (uint8_t const *)item.mem;
+	if (item.num_strips > 1)
+	{
+		JpegStrips strips(item.info.width, item.info.height, options_->mjpeg_strips);
+		strips.Encode(cinfo, mem, item.info, item.quality, item.strip, buffer);
+	}
+	else
+	{
+		jpeg_buffer_dest(&cinfo, &buffer);
+		YUV420_to_JPEG_rows(cinfo, mem, item.info, item.quality, 0, 0, item.info.height);
+	}
 }
 
 void MjpegEncoder::encodeThread(int num)
@@ -99,95 +148,161 @@ void MjpegEncoder::encodeThread(int num)
 	jpeg_create_compress(&cinfo);
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
+	char const *what = "frames";
 
 	EncodeItem encode_item;
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			encode_cond_var_.wait(lock, [this] { return abortEncode_ || !encode_queue_.empty(); });
+			if (encode_queue_.empty())
 			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
+				if (frames)
+					LOG(2, "Encode " << frames << " " << what << ", average time "
+									 << encode_time.count() * 1000 / frames << "ms");
+				jpeg_destroy_compress(&cinfo);
+				return;
 			}
+			encode_item = encode_queue_.front();
+			encode_queue_.pop();
 		}
 
 		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		JpegBuffer buffer = getBuffer();
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		encodeJPEG(cinfo, encode_item, buffer);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
 
-		// We push this encoded buffer to another thread so that our
-		// application can take its time with the data without blocking the
-		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		// The camera buffer can go back as soon as the frame is encoded, even if frames
+		// before it are still going.
+		if (encode_item.num_strips > 1)
+		{
+			what = "strips";
+			stripDone(encode_item, std::move(buffer));
+		}
+		else
+		{
+			input_done_callback_(encode_item.mem);
+			outputDone(encode_item.index, { std::move(buffer), encode_item.timestamp_us, encode_item.quality,
+											encode_item.start_time });
+		}
+	}
+}
+
+void MjpegEncoder::stripDone(EncodeItem &item, JpegBuffer &&buffer)
+{
+	std::vector<JpegBuffer> strip_buffers;
+	{
+		std::lock_guard<std::mutex> lock(strip_mutex_);
+		StripFrame &frame = strip_frames_[item.index];
+		frame.strips[item.strip] = std::move(buffer);
+		if (--frame.remaining)
+			return;
+		strip_buffers = std::move(frame.strips);
+		strip_frames_.erase(item.index);
+	}
+	input_done_callback_(item.mem);
+
+	JpegStrips strips(item.info.width, item.info.height, options_->mjpeg_strips);
+	JpegBuffer output = getBuffer();
+	output.size = strips.StitchedSize(strip_buffers.data());
+	if (output.data.size() < output.size)
+		output.data.resize(output.size);
+	strips.Stitch(strip_buffers.data(), output.data.data());
+	for (auto &strip_buffer : strip_buffers)
+		returnBuffer(std::move(strip_buffer));
+
+	outputDone(item.index, { std::move(output), item.timestamp_us, item.quality, item.start_time });
+}
+
+void MjpegEncoder::outputDone(uint64_t index, OutputItem &&item)
+{
+	// We push this encoded buffer to another thread so that our
+	// application can take its time with the data without blocking the
+	// encode process. Only wake the output thread if it's the frame it wants.
+	bool next;
+	{
 		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		output_items_.emplace(index, std::move(item));
+		next = output_items_.begin()->first == index;
 	}
+	if (next)
+		output_cond_var_.notify_one();
 }
 
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
 	uint64_t index = 0;
+	std::chrono::duration<double> latency(0);
 	while (true)
 	{
+		OutputItem item;
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
+			// Wait for the frame we want next. The abort signal only arrives once all the
+			// encode threads have finished, so at that point everything we're still owed is
+			// already here and must be sent before we stop.
+			output_cond_var_.wait(lock, [this, index] {
+				return (!output_items_.empty() && output_items_.begin()->first == index) ||
+					   (abortOutput_ && output_items_.empty());
+			});
+			if (output_items_.empty())
 			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
+				if (index)
+					LOG(2, "Output " << index << " frames, average latency " << latency.count() * 1000 / index
+									 << "ms");
+				return;
 			}
+			item = std::move(output_items_.begin()->second);
+			output_items_.erase(output_items_.begin());
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		latency += std::chrono::high_resolution_clock::now() - item.start_time;
+		updateRateControl(item.buffer.size, item.timestamp_us);
+
+		statsOutput(item.timestamp_us, item.buffer.size, true);
+		if (quality_ready_callback_)
+			quality_ready_callback_(item.quality);
+		output_ready_callback_(item.buffer.data.data(), item.buffer.size, item.timestamp_us, true);
+		returnBuffer(std::move(item.buffer));
 		index++;
 	}
 }
+
+void MjpegEncoder::updateRateControl(size_t bytes, int64_t timestamp_us)
+{
+	unsigned int bitrate = bitrate_;
+	if (!bitrate)
+	{
+		// If rate control gets turned on later, it starts from wherever the quality is now.
+		rc_scale_ = quality_to_scale(std::clamp(quality_.load(), 1, 100));
+		return;
+	}
+
+	// We average both the frame sizes and the frame times, so that dropped frames or a
+	// changing framerate are accounted for.
+	double alpha = 1.0 / std::max(options_->mjpeg_smoothing, 1u);
+	double bits = bytes * 8.0;
+	rc_bits_ = rc_last_timestamp_ < 0 ? bits : rc_bits_ + alpha * (bits - rc_bits_);
+	if (rc_last_timestamp_ >= 0 && timestamp_us > rc_last_timestamp_)
+	{
+		double frame_time = (timestamp_us - rc_last_timestamp_) / 1000000.0;
+		rc_frame_time_ = rc_frame_time_ ? rc_frame_time_ + alpha * (frame_time - rc_frame_time_) : frame_time;
+	}
+	rc_last_timestamp_ = timestamp_us;
+	if (!rc_frame_time_)
+		return;
+
+	// Compressed size goes roughly inversely with the scale, but frames already in the
+	// encoder were started with older quality values, and the averages lag too. So we only
+	// move part of the way each time, by an amount that shrinks as the smoothing increases.
+	double ratio = (rc_bits_ / rc_frame_time_) / bitrate;
+	rc_scale_ *= std::pow(ratio, std::min(2 * alpha, 1.0));
+	rc_scale_ = std::clamp(rc_scale_, quality_to_scale(MAX_RC_QUALITY), quality_to_scale(MIN_RC_QUALITY));
+	int quality = std::clamp(scale_to_quality(rc_scale_), MIN_RC_QUALITY, MAX_RC_QUALITY);
+	if (quality != quality_)
+		LOG(2, "MjpegEncoder quality now " << quality << " (bitrate " << rc_bits_ / rc_frame_time_ << ")");
+	quality_ = quality;
+}
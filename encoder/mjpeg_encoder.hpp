@@ -7,14 +7,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
-struct jpeg_compress_struct;
+#include "image/jpeg_strips.hpp"
 
 class MjpegEncoder : public Encoder
 {
@@ -23,12 +27,13 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool SetBitrate(unsigned int bitrate) override;
+	bool SetQuality(int quality) override;
+	// Every frame is a keyframe anyway.
+	bool ForceKeyframe() override { return true; }
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
-
-	// These threads do the actual encoding.
+	// These threads do the actual encoding. Whichever thread is idle will pick up the next frame.
 	void encodeThread(int num);
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
@@ -40,27 +45,63 @@ private:
 	bool abortOutput_;
 	uint64_t index_;
 
+	// With a target bitrate, the quality gets adjusted after every frame is output. The
+	// encode threads pick up whatever the current value is when each frame is queued.
+	void updateRateControl(size_t bytes, int64_t timestamp_us);
+	std::atomic<unsigned int> bitrate_;
+	std::atomic<int> quality_;
+	double rc_scale_;
+	double rc_bits_;
+	double rc_frame_time_;
+	int64_t rc_last_timestamp_;
+
 	struct EncodeItem
 	{
 		void *mem;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		int quality;
+		// When frames are split into strips, each strip gets queued as a separate item.
+		unsigned int num_strips;
+		unsigned int strip;
+		std::chrono::high_resolution_clock::time_point start_time;
 	};
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_thread_;
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, JpegBuffer &buffer);
+
+	// Compressed output buffers get recycled, so once we've seen a few frames the encoders
+	// stop allocating memory.
+	JpegBuffer getBuffer();
+	void returnBuffer(JpegBuffer &&buffer);
+	std::vector<JpegBuffer> buffer_pool_;
+	std::mutex buffer_mutex_;
+
+	// The strips of a frame wait here until they're all done, and whichever thread finishes
+	// the last one stitches them together.
+	struct StripFrame
+	{
+		std::vector<JpegBuffer> strips;
+		unsigned int remaining;
+	};
+	void stripDone(EncodeItem &item, JpegBuffer &&buffer);
+	std::map<uint64_t, StripFrame> strip_frames_;
+	std::mutex strip_mutex_;
 
 	struct OutputItem
 	{
-		void *mem;
-		size_t bytes_used;
+		JpegBuffer buffer;
 		int64_t timestamp_us;
-		uint64_t index;
+		int quality;
+		std::chrono::high_resolution_clock::time_point start_time;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	void outputDone(uint64_t index, OutputItem &&item);
+	// Encoded frames may finish in any order, so they wait here, keyed by index, until
+	// the output thread can send them in the right order.
+	std::map<uint64_t, OutputItem> output_items_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
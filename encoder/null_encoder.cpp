@@ -27,6 +27,7 @@ NullEncoder::~NullEncoder()
 // Push the buffer onto the output queue to be "encoded" and returned.
 void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	statsInput(timestamp_us);
 	std::lock_guard<std::mutex> lock(output_mutex_);
 	OutputItem item = { mem, size, timestamp_us };
 	output_queue_.push(item);
@@ -57,7 +58,8 @@ void NullEncoder::outputThread()
 					return;
 			}
 		}
+		statsOutput(item.timestamp_us, item.length, true);
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
-		input_done_callback_(nullptr);
+		input_done_callback_(item.mem);
 	}
 }
@@ -9,6 +9,7 @@
 #include <cstring>
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <map>
 #include <stdexcept>
@@ -23,6 +24,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image/jpeg_strips.hpp"
+
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
 typedef size_t jpeg_mem_len_t;
 #else
@@ -263,9 +266,9 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.image_height = output_height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.restart_interval = restart;
 	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
@@ -304,64 +307,39 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 }
 
 static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
-								const int quality, const unsigned int restart,
+								const int quality, const unsigned int restart, const unsigned int strips,
 								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
+	if (strips > 1)
+	{
+		size_t len;
+		YUV420_to_JPEG_parallel(input, info, quality, strips, jpeg_buffer, len);
+		jpeg_len = len;
+		return;
+	}
+
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
 
-	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
 	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	int stride2 = info.stride / 2;
-	uint8_t *Y = (uint8_t *)input;
-	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
-	uint8_t *Y_max = U - info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (info.height / 2);
-
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
-	{
-		for (int i = 0; i < 16; i++, Y_row += info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+	YUV420_to_JPEG_rows(cinfo, input, info, quality, restart, 0, info.height);
 
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
-	}
-
-	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 }
 
 static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						   const unsigned int output_width, const unsigned int output_height,
-						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
-						   jpeg_mem_len_t &jpeg_len)
+						   const int quality, const unsigned int restart, const unsigned int strips,
+						   uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
 	if (info.width == output_width && info.height == output_height)
 	{
-		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
+		YUV420_to_JPEG_fast(input, info, quality, restart, strips, jpeg_buffer, jpeg_len);
 		return;
 	}
 
@@ -375,9 +353,9 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.image_height = output_height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.restart_interval = restart;
 	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
@@ -421,13 +399,15 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 
 static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						const int output_width, const int output_height, const int quality,
-						const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+						const unsigned int restart, const unsigned int strips, uint8_t *&jpeg_buffer,
+						jpeg_mem_len_t &jpeg_len)
 {
+	// Only the full size YUV420 encode knows how to split the image into strips.
 	if (info.pixel_format == libcamera::formats::YUYV)
 		YUYV_to_JPEG(input, info, output_width, output_height, quality, restart,
 					 jpeg_buffer, jpeg_len);
 	else if (info.pixel_format == libcamera::formats::YUV420)
-		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart,
+		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart, strips,
 					   jpeg_buffer, jpeg_len);
 	else
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
@@ -527,7 +507,7 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem,
 			for (; q > 0; q -= 5)
 			{
 				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->thumb_width,
-							options->thumb_height, q, 0, thumb_buffer, thumb_len);
+							options->thumb_height, q, 0, 1, thumb_buffer, thumb_len);
 				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
 					break;
 				free(thumb_buffer);
@@ -589,9 +569,11 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
+		auto start_time = std::chrono::high_resolution_clock::now();
 		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->quality,
-					options->restart, jpeg_buffer, jpeg_len);
-		LOG(2, "JPEG size is " << jpeg_len);
+					options->restart, options->strips, jpeg_buffer, jpeg_len);
+		std::chrono::duration<double> encode_time = std::chrono::high_resolution_clock::now() - start_time;
+		LOG(2, "JPEG size is " << jpeg_len << ", encode time " << encode_time.count() * 1000 << "ms");
 
 		// Write everything out.
 
@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * jpeg_strips.cpp - encode YUV420 JPEGs in horizontal strips that can run in parallel.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <jpeglib.h>
+
+#include "image/jpeg_strips.hpp"
+
+struct BufferDestination
+{
+	struct jpeg_destination_mgr pub;
+	JpegBuffer *buffer;
+};
+
+static void init_destination(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	// Use all the memory the buffer already has.
+	std::vector<uint8_t> &data = dest->buffer->data;
+	data.resize(std::max<size_t>(data.capacity(), 65536));
+	dest->pub.next_output_byte = data.data();
+	dest->pub.free_in_buffer = data.size();
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	// libjpeg only calls this when the buffer is completely full.
+	std::vector<uint8_t> &data = dest->buffer->data;
+	size_t used = data.size();
+	data.resize(used * 2);
+	dest->pub.next_output_byte = data.data() + used;
+	dest->pub.free_in_buffer = data.size() - used;
+	return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	dest->buffer->size = dest->buffer->data.size() - dest->pub.free_in_buffer;
+}
+
+void jpeg_buffer_dest(jpeg_compress_struct *cinfo, JpegBuffer *buffer)
+{
+	// Like jpeg_mem_dest, we allocate the manager the first time and re-use it after that.
+	if (!cinfo->dest)
+	{
+		cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+																				 sizeof(BufferDestination));
+		cinfo->dest->init_destination = &init_destination;
+		cinfo->dest->empty_output_buffer = &empty_output_buffer;
+		cinfo->dest->term_destination = &term_destination;
+	}
+	((BufferDestination *)cinfo->dest)->buffer = buffer;
+}
+
+void YUV420_to_JPEG_rows(jpeg_compress_struct &cinfo, uint8_t const *input, StreamInfo const &info, int quality,
+						 unsigned int restart, unsigned int y_start, unsigned int y_end)
+{
+	cinfo.image_width = info.width;
+	cinfo.image_height = y_end - y_start;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+	// Must come after jpeg_set_defaults, which would reset it.
+	cinfo.restart_interval = restart;
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	int stride2 = info.stride / 2;
+	uint8_t *Y = (uint8_t *)input;
+	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
+	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
+	uint8_t *Y_max = U - info.stride;
+	uint8_t *U_max = V - stride2;
+	uint8_t *V_max = U_max + stride2 * (info.height / 2);
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	uint8_t *Y_row = Y + y_start * info.stride;
+	uint8_t *U_row = U + (y_start / 2) * stride2;
+	uint8_t *V_row = V + (y_start / 2) * stride2;
+	while (cinfo.next_scanline < cinfo.image_height)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
+			y_rows[i] = std::min(Y_row, Y_max);
+		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(&cinfo, rows, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+}
+
+JpegStrips::JpegStrips(unsigned int width, unsigned int height, unsigned int num_strips) : height_(height)
+{
+	// With 4:2:0 sampling an MCU is 16x16 pixels.
+	unsigned int mcus_per_row = std::max((width + 15) / 16, 1u);
+	unsigned int mcu_rows = std::max((height + 15) / 16, 1u);
+	num_strips = std::clamp(num_strips, 1u, mcu_rows);
+	unsigned int rows = (mcu_rows + num_strips - 1) / num_strips;
+	// The restart interval only has 16 bits, so very wide images may need extra strips.
+	rows = std::min(rows, std::max(65535 / mcus_per_row, 1u));
+
+	strip_height_ = rows * 16;
+	count_ = (mcu_rows + rows - 1) / rows;
+	restart_interval_ = count_ > 1 ? rows * mcus_per_row : 0;
+}
+
+void JpegStrips::Encode(jpeg_compress_struct &cinfo, uint8_t const *input, StreamInfo const &info, int quality,
+						unsigned int strip, JpegBuffer &buffer) const
+{
+	unsigned int y_start = strip * strip_height_;
+	unsigned int y_end = std::min(y_start + strip_height_, height_);
+	jpeg_buffer_dest(&cinfo, &buffer);
+	YUV420_to_JPEG_rows(cinfo, input, info, quality, restart_interval_, y_start, y_end);
+}
+
+// Where the important bits are in one of our strips.
+struct StripLayout
+{
+	size_t sof; // the SOF0 marker, which gives the image height
+	size_t data_start; // entropy coded data starts after the SOS header...
+	size_t data_end; // ...and runs up to the EOI marker
+};
+
+static StripLayout parse_strip(JpegBuffer const &buffer)
+{
+	uint8_t const *p = buffer.data.data();
+	size_t size = buffer.size;
+	if (size < 4 || p[0] != 0xff || p[1] != 0xd8 || p[size - 2] != 0xff || p[size - 1] != 0xd9)
+		throw std::runtime_error("JpegStrips: malformed strip");
+
+	size_t sof = 0;
+	for (size_t pos = 2; pos + 4 <= size;)
+	{
+		if (p[pos] != 0xff)
+			break;
+		uint8_t marker = p[pos + 1];
+		size_t length = (p[pos + 2] << 8) | p[pos + 3];
+		if (marker == 0xc0)
+			sof = pos;
+		pos += 2 + length;
+		if (marker == 0xda && sof && pos <= size - 2)
+			return { sof, pos, size - 2 };
+	}
+	throw std::runtime_error("JpegStrips: failed to find frame and scan headers");
+}
+
+size_t JpegStrips::StitchedSize(JpegBuffer const *strips) const
+{
+	size_t size = parse_strip(strips[0]).data_start;
+	for (unsigned int i = 0; i < count_; i++)
+	{
+		StripLayout layout = parse_strip(strips[i]);
+		size += layout.data_end - layout.data_start + 2; // plus a restart marker, or the EOI
+	}
+	return size;
+}
+
+void JpegStrips::Stitch(JpegBuffer const *strips, uint8_t *dst) const
+{
+	StripLayout header = parse_strip(strips[0]);
+	memcpy(dst, strips[0].data.data(), header.data_start);
+	dst[header.sof + 5] = height_ >> 8;
+	dst[header.sof + 6] = height_ & 0xff;
+	dst += header.data_start;
+
+	for (unsigned int i = 0; i < count_; i++)
+	{
+		StripLayout layout = parse_strip(strips[i]);
+		size_t len = layout.data_end - layout.data_start;
+		memcpy(dst, strips[i].data.data() + layout.data_start, len);
+		dst += len;
+		*dst++ = 0xff;
+		*dst++ = i + 1 < count_ ? 0xd0 + (i & 7) : 0xd9;
+	}
+}
+
+void YUV420_to_JPEG_parallel(uint8_t const *input, StreamInfo const &info, int quality, unsigned int num_strips,
+							 uint8_t *&jpeg_buffer, size_t &jpeg_len)
+{
+	JpegStrips strips(info.width, info.height, num_strips);
+	std::vector<JpegBuffer> buffers(strips.Count());
+
+	auto encode = [&](unsigned int strip) {
+		struct jpeg_compress_struct cinfo;
+		struct jpeg_error_mgr jerr;
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		strips.Encode(cinfo, input, info, quality, strip, buffers[strip]);
+		jpeg_destroy_compress(&cinfo);
+	};
+
+	// This thread does the first strip itself.
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < strips.Count(); i++)
+		threads.emplace_back(encode, i);
+	encode(0);
+	for (auto &thread : threads)
+		thread.join();
+
+	jpeg_len = strips.StitchedSize(buffers.data());
+	jpeg_buffer = (uint8_t *)malloc(jpeg_len);
+	if (!jpeg_buffer)
+		throw std::runtime_error("failed to allocate JPEG buffer");
+	strips.Stitch(buffers.data(), jpeg_buffer);
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * jpeg_strips.hpp - encode YUV420 JPEGs in horizontal strips that can run in parallel.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+struct jpeg_compress_struct;
+
+// A buffer of compressed JPEG data. The vector may be bigger than the data in it; this
+// lets buffers be re-used without being cleared or reallocated every time.
+struct JpegBuffer
+{
+	std::vector<uint8_t> data;
+	size_t size = 0;
+};
+
+// Make libjpeg write into the given buffer, which grows as necessary. The JpegBuffer's
+// size gets set when compression finishes.
+void jpeg_buffer_dest(jpeg_compress_struct *cinfo, JpegBuffer *buffer);
+
+// Compress the YUV420 image rows from y_start up to y_end into a complete JPEG (with
+// y_end - y_start rows). y_start must be a multiple of 16. The caller supplies the
+// destination.
+void YUV420_to_JPEG_rows(jpeg_compress_struct &cinfo, uint8_t const *input, StreamInfo const &info, int quality,
+						 unsigned int restart, unsigned int y_start, unsigned int y_end);
+
+// A JPEG's entropy coded data can only be split where the encoder restarts, that is, at
+// a restart marker. So we set the restart interval to the size of a strip, and encode
+// each strip as if it were a separate image. The JPEG for the first strip, with the image
+// height corrected, gives us all the headers, and then the strips' entropy coded data
+// can simply be joined up with the right restart markers in between. Because every strip
+// uses the same standard Huffman tables, the result is a valid baseline JPEG, and in
+// fact exactly the same as one encoded in one go with that restart interval.
+
+class JpegStrips
+{
+public:
+	// Split the image into at most num_strips strips, each a whole number of MCU rows.
+	JpegStrips(unsigned int width, unsigned int height, unsigned int num_strips);
+
+	unsigned int Count() const { return count_; }
+
+	unsigned int RestartInterval() const { return restart_interval_; }
+
+	// Encode one strip into a JPEG of its own.
+	void Encode(jpeg_compress_struct &cinfo, uint8_t const *input, StreamInfo const &info, int quality,
+				unsigned int strip, JpegBuffer &buffer) const;
+
+	// The size of the JPEG made by stitching together all the strips, and the stitching
+	// itself. dst must have room for StitchedSize bytes.
+	size_t StitchedSize(JpegBuffer const *strips) const;
+	void Stitch(JpegBuffer const *strips, uint8_t *dst) const;
+
+private:
+	unsigned int height_;
+	unsigned int strip_height_;
+	unsigned int count_;
+	unsigned int restart_interval_;
+};
+
+// Compress a whole YUV420 image using the given number of strips, each in its own thread.
+void YUV420_to_JPEG_parallel(uint8_t const *input, StreamInfo const &info, int quality, unsigned int num_strips,
+							 uint8_t *&jpeg_buffer, size_t &jpeg_len);
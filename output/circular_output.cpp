@@ -5,11 +5,118 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
 #include "circular_output.hpp"
 
+static constexpr char MAGIC[8] = { 'L', 'C', 'C', 'I', 'R', 'C', '0', '1' };
+
+CircularBuffer::CircularBuffer(size_t size, std::string const &filename)
+	: size_(size), map_(nullptr), header_(nullptr), buf_(nullptr), rptr_(0), wptr_(0)
+{
+	if (filename.empty())
+	{
+		mem_.resize(size);
+		buf_ = mem_.data();
+		return;
+	}
+
+	int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("failed to open circular buffer file " + filename);
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (st.st_size != (off_t)(FILE_HEADER_SIZE + size_) &&
+							   ftruncate(fd, FILE_HEADER_SIZE + size_) < 0))
+	{
+		close(fd);
+		throw std::runtime_error("failed to size circular buffer file " + filename);
+	}
+	map_ = (uint8_t *)mmap(nullptr, FILE_HEADER_SIZE + size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map_ == MAP_FAILED)
+		throw std::runtime_error("failed to map circular buffer file " + filename);
+	header_ = (FileHeader *)map_;
+	buf_ = map_ + FILE_HEADER_SIZE;
+
+	// Carry on from where we were if the file is one of ours and the same size, otherwise start afresh.
+	if (!memcmp(header_->magic, MAGIC, sizeof(MAGIC)) && header_->size == size_ && header_->rptr <= header_->wptr &&
+		header_->wptr - header_->rptr <= size_)
+	{
+		rptr_ = header_->rptr;
+		wptr_ = header_->wptr;
+	}
+	else
+	{
+		memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+		header_->size = size_;
+		Sync();
+	}
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	if (map_)
+	{
+		Sync();
+		// Stopping cleanly is the one time we wait for everything to reach the disk.
+		msync(map_, FILE_HEADER_SIZE + size_, MS_SYNC);
+		munmap(map_, FILE_HEADER_SIZE + size_);
+	}
+}
+
+void CircularBuffer::Peek(uint64_t pos, void *dst, unsigned int n) const
+{
+	size_t offset = pos % size_;
+	size_t first = std::min((size_t)n, size_ - offset);
+	memcpy(dst, buf_ + offset, first);
+	memcpy((uint8_t *)dst + first, buf_, n - first);
+}
+
+unsigned int CircularBuffer::Regions(uint64_t pos, size_t n, struct iovec iov[2]) const
+{
+	size_t offset = pos % size_;
+	size_t first = std::min(n, size_ - offset);
+	iov[0] = { buf_ + offset, first };
+	if (first == n)
+		return 1;
+	iov[1] = { buf_, n - first };
+	return 2;
+}
+
+void CircularBuffer::Write(const void *ptr, unsigned int n)
+{
+	size_t offset = wptr_ % size_;
+	size_t first = std::min((size_t)n, size_ - offset);
+	memcpy(buf_ + offset, ptr, first);
+	memcpy(buf_, (const uint8_t *)ptr + first, n - first);
+	wptr_ += n;
+}
+
+void CircularBuffer::Sync()
+{
+	if (!header_)
+		return;
+	// The data must land before the positions that say it's there. Once in the page cache, it
+	// survives us crashing, and the kernel gets it to the disk in its own time (and in whatever
+	// order it likes, which is why we don't promise anything after a power cut).
+	std::atomic_thread_fence(std::memory_order_release);
+	header_->rptr = rptr_;
+	header_->wptr = wptr_;
+}
+
 // We're going to align the frames within the buffer to friendly byte boundaries
 static constexpr int ALIGN = 16; // power of 2, please
 
+// Frames are saved this many at a time, with a single writev.
+static constexpr unsigned int DUMP_BATCH = 64;
+
 struct Header
 {
 	unsigned int length;
@@ -18,78 +125,237 @@ struct Header
 };
 static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
 
+static size_t frame_size(unsigned int length)
+{
+	return sizeof(Header) + ((length + ALIGN - 1) & ~(ALIGN - 1));
+}
+
+static bool write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt)
+	{
+		ssize_t n = writev(fd, iov, std::min(iovcnt, IOV_MAX));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		for (; iovcnt && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
 // Size of buffer (options->circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->circular<<20)
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(options->circular << 20, options->circular_file), fd_(-1), count_(0), dumping_(false)
 {
 	// Open this now, so that we can get any complaints out of the way
-	if (options_->output == "-")
-		fp_ = stdout;
-	else if (!options_->output.empty())
+	fd_ = openDumpFile();
+
+	// Frames left in a file-backed buffer from last time should all hang together, or we can't use
+	// them. This is the only time we have to read the headers in the buffer.
+	uint64_t pos = cb_.ReadPos();
+	while (pos < cb_.WritePos())
+	{
+		Header header;
+		cb_.Peek(pos, &header, sizeof(header));
+		if (frame_size(header.length) > cb_.WritePos() - pos)
+			break;
+		index_.push_back({ pos, header.length, header.keyframe, header.timestamp });
+		pos += frame_size(header.length);
+	}
+	if (pos != cb_.WritePos())
 	{
-		fp_ = fopen(options_->output.c_str(), "w");
+		LOG_ERROR("CircularOutput: discarding corrupt contents of " << options->circular_file);
+		index_.clear();
+		cb_.Reset();
+		cb_.Sync();
 	}
-	if (!fp_)
-		throw std::runtime_error("could not open output file");
+	else if (!cb_.Empty())
+		LOG(1, "CircularOutput: recovered " << index_.size() << " frames from " << options->circular_file);
 }
 
 CircularOutput::~CircularOutput()
+{
+	if (dump_thread_.joinable())
+		dump_thread_.join();
+	try
+	{
+		uint64_t pos, end;
+		dumpRange(pos, end);
+		dump(fd_ >= 0 ? fd_ : openDumpFile(), pos, end);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("CircularOutput: " << e.what());
+	}
+}
+
+int CircularOutput::openDumpFile()
+{
+	if (options_->output == "-")
+		return STDOUT_FILENO;
+
+	// Every dump gets the next file name, if the output has a pattern for it.
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_++);
+	int fd = n < 0 ? -1 : open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("could not open output file");
+	return fd;
+}
+
+void CircularOutput::Signal()
+{
+	// Signals are handled on the thread that does the recording, so we mustn't wait for a dump
+	// that's still going. The signal is ignored instead.
+	if (dumping_)
+	{
+		LOG(1, "CircularOutput: still saving the last dump, ignoring signal");
+		return;
+	}
+	if (dump_thread_.joinable())
+		dump_thread_.join();
+	try
+	{
+		int fd = fd_ >= 0 ? fd_ : openDumpFile();
+		fd_ = -1;
+		uint64_t pos, end;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			dumpRange(pos, end);
+		}
+		dumping_ = true;
+		dump_thread_ = std::thread([this, fd, pos, end] {
+			dump(fd, pos, end);
+			dumping_ = false;
+		});
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("CircularOutput: " << e.what());
+	}
+}
+
+void CircularOutput::dumpRange(uint64_t &pos, uint64_t &end) const
 {
 	// We do have to skip to the first I frame before dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
+	// With --circular-dump, we start instead from the last I frame that gives us at least that
+	// much video.
+	end = cb_.WritePos();
+	auto start = std::find_if(index_.begin(), index_.end(), [](Frame const &f) { return f.keyframe; });
+	if (options_->circular_dump && !index_.empty())
+	{
+		int64_t from = index_.back().timestamp - (int64_t)options_->circular_dump * 1000;
+		for (auto it = index_.rbegin(); it != index_.rend(); it++)
+		{
+			if (it->keyframe && it->timestamp <= from)
+			{
+				start = std::prev(it.base());
+				break;
+			}
+		}
+	}
+	pos = start == index_.end() ? end : start->pos;
+}
+
+void CircularOutput::dump(int fd, uint64_t pos, uint64_t end)
+{
+	// Frames keep arriving while we do this, so we only hold the lock to find the next batch of
+	// frames, and check afterwards that none of them got overwritten while we wrote them. Frames
+	// only get overwritten after the read position has moved past them.
 	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
-	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+	std::vector<Frame> batch;
+	std::vector<struct iovec> iov;
+	batch.reserve(DUMP_BATCH);
+	iov.reserve(2 * DUMP_BATCH);
+	while (pos < end)
+	{
+		batch.clear();
+		iov.clear();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (pos < cb_.ReadPos())
+			{
+				LOG_ERROR("CircularOutput: recording overwrote frames before they were saved");
+				break;
+			}
+			auto it = std::lower_bound(index_.begin(), index_.end(), pos,
+									   [](Frame const &f, uint64_t pos) { return f.pos < pos; });
+			for (; it != index_.end() && it->pos < end && batch.size() < DUMP_BATCH; it++)
+				batch.push_back(*it);
+		}
+		for (Frame const &frame : batch)
+		{
+			struct iovec regions[2];
+			unsigned int n = cb_.Regions(frame.pos + sizeof(Header), frame.length, regions);
+			iov.insert(iov.end(), regions, regions + n);
+		}
+
+		// The buffer is read without the lock, so if any of the batch got overwritten we take it
+		// back out of the file again (which we can only do if the file is seekable).
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		bool ok = write_all(fd, iov.data(), iov.size());
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (batch.front().pos < cb_.ReadPos())
+			{
+				if (offset >= 0 && ftruncate(fd, offset) == 0 && lseek(fd, offset, SEEK_SET) == offset)
+					LOG_ERROR("CircularOutput: recording overwrote frames while they were being saved");
+				else
+					LOG_ERROR("CircularOutput: recording overwrote frames while they were being saved, "
+							  "output may be corrupt");
+				break;
+			}
+		}
+		if (!ok)
+		{
+			LOG_ERROR("CircularOutput: failed to write output: " << strerror(errno));
+			break;
+		}
+
+		for (Frame const &frame : batch)
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
+			total += frame.length;
 			if (fp_timestamps_)
 			{
-				Output::timestampReady(header.timestamp);
+				Output::timestampReady(frame.timestamp);
 			}
-			frames++;
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		frames += batch.size();
+		pos = batch.back().pos + frame_size(batch.back().length);
 	}
-	fclose(fp_);
+	if (fd != STDOUT_FILENO)
+		close(fd);
 	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
 }
 
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
 	// First make sure there's enough space.
 	int pad = (ALIGN - size) & (ALIGN - 1);
 	while (size + pad + sizeof(Header) > cb_.Available())
 	{
-		if (cb_.Empty())
+		if (index_.empty())
 			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		cb_.Skip(frame_size(index_.front().length));
+		index_.pop_front();
 	}
+	// Frames we're about to overwrite must be gone from the file before we start.
+	cb_.Sync();
 	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
+	index_.push_back({ cb_.WritePos(), header.length, header.keyframe, header.timestamp });
 	cb_.Write(&header, sizeof(header));
 	cb_.Write(mem, size);
 	cb_.Pad(pad);
+	cb_.Sync();
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
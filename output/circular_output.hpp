@@ -7,62 +7,99 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
 
-// A simple circular buffer implementation used by the CircularOutput class.
+// A simple circular buffer implementation used by the CircularOutput class. It can live in
+// memory, or in a file that is mapped into memory, in which case the contents survive us (even
+// if we crash) and are picked up again next time. We leave it to the kernel to write the file
+// back, so a power cut can still lose or corrupt it.
 
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
+	CircularBuffer(size_t size, std::string const &filename);
+	~CircularBuffer();
 	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
-	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
-	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
-	}
+	size_t Available() const { return size_ - (wptr_ - rptr_); }
+	// Positions only ever increase, so comparing them tells you whether anything has been overwritten.
+	uint64_t ReadPos() const { return rptr_; }
+	uint64_t WritePos() const { return wptr_; }
+	void Skip(unsigned int n) { rptr_ += n; }
+	// Copy bytes out from any position that is still in the buffer.
+	void Peek(uint64_t pos, void *dst, unsigned int n) const;
+	// Describe where n bytes starting at pos are in memory. This may be one or two regions, depending
+	// on whether they wrap around, and we return how many.
+	unsigned int Regions(uint64_t pos, size_t n, struct iovec iov[2]) const;
+	void Pad(unsigned int n) { wptr_ += n; }
+	void Write(const void *ptr, unsigned int n);
+	void Reset() { rptr_ = wptr_ = 0; }
+	// Record the read and write positions in the file. Doing this only between whole frames means
+	// that the file always describes a complete set of frames.
+	void Sync();
 
 private:
-	const size_t size_;
-	std::vector<uint8_t> buf_;
-	size_t rptr_, wptr_;
+	struct FileHeader
+	{
+		char magic[8];
+		uint64_t size;
+		uint64_t rptr;
+		uint64_t wptr;
+	};
+	static constexpr size_t FILE_HEADER_SIZE = 4096;
+
+	size_t size_;
+	std::vector<uint8_t> mem_;
+	uint8_t *map_;
+	FileHeader *header_;
+	uint8_t *buf_;
+	uint64_t rptr_, wptr_;
 };
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit, or whenever we are signalled.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	// Dump the buffer without stopping the recording.
+	void Signal() override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 	void timestampReady(int64_t timestamp) override;
+	bool mayBlock() const override { return false; }
 
 private:
+	int openDumpFile();
+	// Find the range of the buffer to save, with the lock held.
+	void dumpRange(uint64_t &pos, uint64_t &end) const;
+	void dump(int fd, uint64_t pos, uint64_t end);
+
 	CircularBuffer cb_;
-	FILE *fp_;
+	// Every frame in the buffer is listed here too, so that we never have to search through the
+	// buffer itself to find them.
+	struct Frame
+	{
+		uint64_t pos;
+		unsigned int length;
+		bool keyframe;
+		int64_t timestamp;
+	};
+	std::deque<Frame> index_;
+	std::mutex mutex_;
+	int fd_;
+	unsigned int count_;
+	std::thread dump_thread_;
+	// Set while the dump thread is saving the buffer.
+	std::atomic<bool> dumping_;
 };
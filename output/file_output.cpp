@@ -5,69 +5,393 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
 #include "file_output.hpp"
 
+// Transport stream packets are made this many at a time, before being copied into the blocks.
+static constexpr size_t TS_BATCH = 64;
+
+// Turn the output file name into a regular expression that matches any of the names it could
+// generate, so that we know which files count towards the quota.
+static std::string filename_regex(std::string const &pattern)
+{
+	std::string regex;
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		if (pattern[i] == '%' && i + 1 < pattern.size() && pattern[i + 1] == '%')
+			regex += pattern[++i];
+		else if (pattern[i] == '%')
+		{
+			i = pattern.find_first_of("diuxX", i);
+			if (i == std::string::npos)
+				throw std::runtime_error("bad conversion in output file name " + pattern);
+			regex += "[0-9a-fA-F]+";
+			continue;
+		}
+		else if (std::strchr(".^$|()[]{}*+?\\", pattern[i]))
+			regex += std::string("\\") + pattern[i];
+		else
+			regex += pattern[i];
+	}
+	return regex;
+}
+
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), file_open_(false), file_offset_(0), count_(0), file_start_time_ms_(0),
+	  segment_keyframe_requested_(false), segment_estimate_(0), max_segment_size_(0), block_(-1), block_used_(0),
+	  fd_(-1), seekable_(false), base_offset_(0), preallocated_(false), quota_(options->segment_quota << 20),
+	  abort_(false), write_error_(false), fsync_period_(options->file_fsync), stalls_(0), max_queue_depth_(0),
+	  blocks_written_(0), bytes_written_(0), total_write_time_(0), max_write_time_(0)
 {
+	unsigned int num_blocks = std::max((options->file_buffer << 20) / BLOCK_SIZE, (size_t)2);
+	for (unsigned int i = 0; i < num_blocks; i++)
+	{
+		uint8_t *block = (uint8_t *)std::aligned_alloc(BLOCK_ALIGN, BLOCK_SIZE);
+		if (!block)
+			throw std::runtime_error("failed to allocate file output buffers");
+		blocks_.push_back(block);
+		free_blocks_.push_back(i);
+	}
+
+	if (quota_ && !options->output.empty() && options->output != "-")
+	{
+		size_t slash = options->output.rfind('/');
+		quota_dir_ = slash == std::string::npos ? "." : options->output.substr(0, slash + 1);
+		quota_regex_ = std::regex(filename_regex(options->output.substr(slash + 1)));
+	}
+	else
+		quota_ = 0;
+
+	// With a bitrate we know roughly how big each segment will be, otherwise we go by the biggest so far.
+	if (options->segment && options->bitrate)
+		segment_estimate_ = (size_t)options->bitrate / 8 * options->segment / 1000 * 5 / 4;
+
+	// Segments (and split files) start on keyframes, which always come with the PAT and PMT, so each
+	// file is a complete transport stream.
+	if (options->mpegts)
+		ts_ = std::make_unique<TsMuxer>(TS_BATCH, [this](uint8_t *data, size_t size) { copyToBlocks(data, size); });
+
+	writer_thread_ = std::thread(&FileOutput::writerThread, this);
 }
 
 FileOutput::~FileOutput()
 {
 	closeFile();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	job_cond_var_.notify_one();
+	writer_thread_.join();
+	for (uint8_t *block : blocks_)
+		std::free(block);
+
+	if (blocks_written_)
+		LOG(2, "FileOutput: wrote " << bytes_written_ << " bytes in " << blocks_written_ << " writes, write time "
+									<< total_write_time_.count() * 1000 / blocks_written_ << "ms (max "
+									<< max_write_time_.count() * 1000 << "ms), max queue depth " << max_queue_depth_
+									<< " of " << blocks_.size() << ", stalled " << stalls_ << " times");
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
+	if (write_error_)
+		throw std::runtime_error("failed to write output bytes");
+
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (!file_open_ ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
 	{
 		closeFile();
 		openFile(timestamp_us);
+		segment_keyframe_requested_ = false;
+	}
+	else if (options_->segment && !segment_keyframe_requested_ &&
+			 timestamp_us / 1000 - file_start_time_ms_ > options_->segment)
+	{
+		// The segment is full, so don't wait for the encoder's next natural I frame.
+		requestKeyframe();
+		segment_keyframe_requested_ = true;
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+	if (!file_open_ || !size)
+		return;
+
+	if (ts_)
+		ts_->Mux((uint8_t *)mem, size, timestamp_us, flags & FLAG_KEYFRAME);
+	else
+		copyToBlocks((uint8_t *)mem, size);
+
+	// Flushing means not hanging on to anything, even if the block isn't full.
+	if (options_->flush)
+		submitBlock();
+}
+
+void FileOutput::copyToBlocks(uint8_t const *src, size_t size)
+{
+	while (size)
 	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->flush)
-			fflush(fp_);
+		if (block_ < 0)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (free_blocks_.empty())
+			{
+				if (!stalls_++)
+					LOG(1, "FileOutput: writes are falling behind, consider a bigger --file-buffer");
+				free_cond_var_.wait(lock, [this] { return !free_blocks_.empty(); });
+			}
+			block_ = free_blocks_.back();
+			free_blocks_.pop_back();
+			block_used_ = 0;
+		}
+
+		size_t n = std::min(size, BLOCK_SIZE - block_used_);
+		memcpy(blocks_[block_] + block_used_, src, n);
+		block_used_ += n;
+		src += n;
+		size -= n;
+		if (block_used_ == BLOCK_SIZE)
+			submitBlock();
 	}
 }
 
+void FileOutput::submitBlock()
+{
+	if (block_ < 0)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_.push({ Job::WRITE, std::string(), file_offset_, block_, block_used_ });
+		max_queue_depth_ = std::max(max_queue_depth_, (unsigned int)jobs_.size());
+	}
+	job_cond_var_.notify_one();
+	file_offset_ += block_used_;
+	block_ = -1;
+}
+
 void FileOutput::openFile(int64_t timestamp_us)
 {
+	std::string filename;
+	size_t preallocate = 0;
 	if (options_->output == "-")
-		fp_ = stdout;
+		filename = "-";
 	else if (!options_->output.empty())
 	{
 		// Generate the next output file name.
-		char filename[256];
-		int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
+		char name[256];
+		int n = snprintf(name, sizeof(name), options_->output.c_str(), count_);
 		count_++;
 		if (options_->wrap)
 			count_ = count_ % options_->wrap;
 		if (n < 0)
 			throw std::runtime_error("failed to generate filename");
-
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
-		LOG(2, "FileOutput: opened output file " << filename);
+		filename = name;
 
 		file_start_time_ms_ = timestamp_us / 1000;
+		if (options_->segment)
+			preallocate = std::max(segment_estimate_, max_segment_size_);
 	}
+	else
+		return;
+
+	// The writer thread does the actual opening, so that we never wait for the filesystem here.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_.push({ Job::OPEN, filename, 0, -1, preallocate });
+	}
+	job_cond_var_.notify_one();
+	file_open_ = true;
+	file_offset_ = 0;
 }
 
 void FileOutput::closeFile()
 {
-	if (fp_ && fp_ != stdout)
-		fclose(fp_);
-	fp_ = nullptr;
+	if (!file_open_)
+		return;
+	// The file gets closed once everything queued before it has been written.
+	submitBlock();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_.push({ Job::CLOSE, std::string(), file_offset_, -1, 0 });
+	}
+	job_cond_var_.notify_one();
+	max_segment_size_ = std::max(max_segment_size_, (size_t)file_offset_);
+	file_open_ = false;
+}
+
+void FileOutput::writerOpen(Job const &job)
+{
+	if (job.filename == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		fd_ = open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd_ < 0)
+		{
+			LOG_ERROR("FileOutput: failed to open output file " << job.filename << ": " << strerror(errno));
+			write_error_ = true;
+			return;
+		}
+		LOG(2, "FileOutput: opened output file " << job.filename);
+	}
+
+	// Pipes can't take pwrite, so they just get written in order.
+	base_offset_ = lseek(fd_, 0, SEEK_CUR);
+	seekable_ = base_offset_ >= 0;
+	if (!seekable_)
+		base_offset_ = 0;
+
+	if (quota_)
+		enforceQuota(job.filename, job.size);
+
+	// Reserving the whole segment up front stops it getting fragmented as it grows. Not all
+	// filesystems can do this, in which case we just carry on without.
+	preallocated_ = false;
+	if (seekable_ && job.size)
+	{
+		if (fallocate(fd_, 0, base_offset_, job.size) == 0)
+			preallocated_ = true;
+		else
+			LOG(2, "FileOutput: unable to preallocate " << job.filename << ": " << strerror(errno));
+	}
+}
+
+void FileOutput::writerWrite(Job const &job)
+{
+	auto start_time = std::chrono::steady_clock::now();
+	uint8_t const *data = blocks_[job.block];
+	for (size_t done = 0; done < job.size && fd_ >= 0 && !write_error_;)
+	{
+		ssize_t n = seekable_ ? pwrite(fd_, data + done, job.size - done, base_offset_ + job.offset + done)
+							  : write(fd_, data + done, job.size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			LOG_ERROR("FileOutput: write failed: " << strerror(errno));
+			write_error_ = true;
+			break;
+		}
+		done += n;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	blocks_written_++;
+	bytes_written_ += job.size;
+	total_write_time_ += now - start_time;
+	max_write_time_ = std::max(max_write_time_, std::chrono::duration<double>(now - start_time));
+}
+
+void FileOutput::writerClose(Job const &job)
+{
+	if (fd_ < 0)
+		return;
+	// Give back whatever we preallocated but didn't use.
+	if (preallocated_ && ftruncate(fd_, base_offset_ + job.offset) < 0)
+		LOG_ERROR("FileOutput: failed to truncate output file: " << strerror(errno));
+	if (fsync_period_.count() && fsync(fd_) < 0 && errno != EINVAL)
+		LOG_ERROR("FileOutput: fsync failed");
+	if (fd_ != STDOUT_FILENO)
+		close(fd_);
+	fd_ = -1;
+}
+
+void FileOutput::enforceQuota(std::string const &current, size_t needed)
+{
+	struct Entry
+	{
+		std::string path;
+		off_t size;
+		struct timespec mtime;
+	};
+	std::vector<Entry> entries;
+	off_t total = needed;
+
+	DIR *dir = opendir(quota_dir_.c_str());
+	if (!dir)
+	{
+		LOG_ERROR("FileOutput: unable to read directory " << quota_dir_ << " for quota");
+		return;
+	}
+	while (struct dirent *ent = readdir(dir))
+	{
+		if (!std::regex_match(ent->d_name, quota_regex_))
+			continue;
+		std::string path = quota_dir_ == "." ? std::string(ent->d_name) : quota_dir_ + ent->d_name;
+		struct stat st;
+		if (path == current || stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		entries.push_back({ path, st.st_size, st.st_mtim });
+		total += st.st_size;
+	}
+	closedir(dir);
+
+	std::sort(entries.begin(), entries.end(), [](Entry const &a, Entry const &b) {
+		return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+	});
+	for (auto it = entries.begin(); it != entries.end() && total > quota_; it++)
+	{
+		if (unlink(it->path.c_str()) < 0)
+		{
+			LOG_ERROR("FileOutput: failed to delete " << it->path << ": " << strerror(errno));
+			continue;
+		}
+		LOG(2, "FileOutput: deleted " << it->path << " to stay within quota");
+		total -= it->size;
+	}
+	if (total > quota_)
+		LOG(1, "FileOutput: unable to keep output within quota");
+}
+
+void FileOutput::writerThread()
+{
+	auto last_fsync = std::chrono::steady_clock::now();
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			job_cond_var_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+			if (jobs_.empty())
+				return;
+			job = std::move(jobs_.front());
+			jobs_.pop();
+		}
+
+		if (job.type == Job::OPEN)
+			writerOpen(job);
+		else if (job.type == Job::CLOSE)
+			writerClose(job);
+		else
+		{
+			writerWrite(job);
+
+			auto now = std::chrono::steady_clock::now();
+			if (fsync_period_.count() && fd_ >= 0 && now - last_fsync >= fsync_period_)
+			{
+				if (fsync(fd_) < 0 && errno != EINVAL)
+					LOG_ERROR("FileOutput: fsync failed");
+				last_fsync = now;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				free_blocks_.push_back(job.block);
+			}
+			free_cond_var_.notify_one();
+		}
+	}
 }
@@ -7,7 +7,21 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
+#include "ts_muxer.hpp"
 
 class FileOutput : public Output
 {
@@ -19,9 +33,78 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// Encoded data is copied into large aligned blocks which a separate thread writes out, so
+	// that slow storage doesn't hold up the encoder (unless all the blocks fill up). That thread
+	// also opens and closes the files, so segments rotate without the encoder waiting either.
+	static constexpr size_t BLOCK_SIZE = 1 << 20;
+	static constexpr size_t BLOCK_ALIGN = 4096;
+
 	void openFile(int64_t timestamp_us);
 	void closeFile();
-	FILE *fp_;
+	void copyToBlocks(uint8_t const *src, size_t size);
+	void submitBlock();
+	void writerThread();
+
+	bool file_open_;
+	off_t file_offset_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	bool segment_keyframe_requested_;
+	// Segments are preallocated to roughly the size we expect them to reach.
+	size_t segment_estimate_;
+	size_t max_segment_size_;
+	// The block we're filling, if any, and how much is in it.
+	int block_;
+	size_t block_used_;
+	// With --mpegts, the transport stream packets get copied into the blocks instead.
+	std::unique_ptr<TsMuxer> ts_;
+
+	// Jobs open a file (preallocating size bytes), write a block to the open file at the given
+	// offset, or close the file (truncating it to offset bytes if it was preallocated).
+	struct Job
+	{
+		enum Type
+		{
+			OPEN,
+			WRITE,
+			CLOSE
+		} type;
+		std::string filename;
+		off_t offset;
+		int block;
+		size_t size;
+	};
+	void writerOpen(Job const &job);
+	void writerWrite(Job const &job);
+	void writerClose(Job const &job);
+	// Only the writer thread touches these.
+	int fd_;
+	bool seekable_;
+	off_t base_offset_;
+	bool preallocated_;
+
+	// With a quota, the oldest files that the output name could have generated are deleted to make room.
+	void enforceQuota(std::string const &current, size_t needed);
+	off_t quota_;
+	std::string quota_dir_;
+	std::regex quota_regex_;
+
+	std::vector<uint8_t *> blocks_;
+	std::vector<int> free_blocks_;
+	std::queue<Job> jobs_;
+	std::mutex mutex_;
+	std::condition_variable free_cond_var_;
+	std::condition_variable job_cond_var_;
+	bool abort_;
+	std::atomic<bool> write_error_;
+	std::thread writer_thread_;
+	std::chrono::milliseconds fsync_period_;
+
+	// Stats, reported when we finish.
+	unsigned int stalls_;
+	unsigned int max_queue_depth_;
+	uint64_t blocks_written_;
+	uint64_t bytes_written_;
+	std::chrono::duration<double> total_write_time_;
+	std::chrono::duration<double> max_write_time_;
 };
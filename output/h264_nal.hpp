@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * h264_nal.hpp - find the NAL units in an H.264 byte stream.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum NalUnitType
+{
+	NAL_SLICE = 1,
+	NAL_IDR_SLICE = 5,
+	NAL_SEI = 6,
+	NAL_SPS = 7,
+	NAL_PPS = 8,
+	NAL_AUD = 9
+};
+
+// Call f(nal, size) for each NAL unit in an Annex B byte stream, by looking for the 00 00 01
+// start codes in between them. Any zeros before a start code aren't part of the previous NAL unit.
+template <typename F>
+void for_each_nal_unit(uint8_t *mem, size_t size, F f)
+{
+	uint8_t *end = mem + size, *nal = nullptr;
+	for (uint8_t *ptr = mem; ptr + 3 <= end;)
+	{
+		if (ptr[2] > 1)
+			ptr += 3;
+		else if (ptr[2] == 1 && ptr[1] == 0 && ptr[0] == 0)
+		{
+			if (nal)
+			{
+				uint8_t *nal_end = ptr;
+				while (nal_end > nal && nal_end[-1] == 0)
+					nal_end--;
+				if (nal_end > nal)
+					f(nal, nal_end - nal);
+			}
+			ptr += 3;
+			nal = ptr;
+		}
+		else
+			ptr++;
+	}
+	if (nal && end > nal)
+		f(nal, end - nal);
+}
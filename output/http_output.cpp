@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * http_output.cpp - serve MJPEG over HTTP.
+ */
+
+#include <cstring>
+
+#include "http_output.hpp"
+
+// Most JPEGs we queue for any one client before it has to skip frames.
+static constexpr size_t CLIENT_QUEUE_SIZE = 4 << 20;
+
+static const std::string BOUNDARY = "frame";
+
+HttpOutput::HttpOutput(VideoOptions const *options) : Output(options)
+{
+	if (options->codec != "mjpeg")
+		throw std::runtime_error("http output only supports the mjpeg codec");
+
+	// Only the port matters, and optionally the path we serve on.
+	int port;
+	if (sscanf(options->output.c_str(), "http://%*[^:/]:%d", &port) != 1 &&
+		sscanf(options->output.c_str(), "http://:%d", &port) != 1)
+		throw std::runtime_error("bad http address " + options->output);
+	size_t slash = options->output.find('/', 7);
+	if (slash != std::string::npos && slash + 1 < options->output.size())
+		path_ = options->output.substr(slash);
+
+	server_ = std::make_unique<StreamServer>(
+		"HttpOutput", port, CLIENT_QUEUE_SIZE,
+		[this](std::string const &request, StreamServer::Handshake &handshake) {
+			return handleRequest(request, handshake);
+		},
+		nullptr);
+}
+
+bool HttpOutput::handleRequest(std::string const &request, StreamServer::Handshake &handshake)
+{
+	if (request.find("\r\n\r\n") == std::string::npos)
+		return false;
+
+	// We only need the request line: "GET <path>[?<query>] HTTP/1.x".
+	size_t method_end = request.find(' ');
+	size_t target_end = request.find(' ', method_end + 1);
+	std::string method = request.substr(0, method_end);
+	std::string target =
+		method_end == std::string::npos ? "" : request.substr(method_end + 1, target_end - method_end - 1);
+	std::string path = target.substr(0, target.find('?'));
+	std::string query = target.size() > path.size() ? target.substr(path.size() + 1) : "";
+
+	handshake.close = true;
+	if (method != "GET")
+		handshake.response = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n";
+	else if (!path_.empty() && path != path_)
+		handshake.response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	else
+	{
+		handshake.close = false;
+		handshake.response = "HTTP/1.1 200 OK\r\n"
+							 "Content-Type: multipart/x-mixed-replace; boundary=" +
+							 BOUNDARY +
+							 "\r\n"
+							 "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+							 "Pragma: no-cache\r\n"
+							 "Connection: close\r\n\r\n";
+		for (size_t pos = 0; pos < query.size();)
+		{
+			size_t end = std::min(query.find('&', pos), query.size());
+			if (query.compare(pos, 4, "fps=") == 0)
+				handshake.fps = strtod(query.c_str() + pos + 4, nullptr);
+			pos = end + 1;
+		}
+	}
+	LOG(2, "HttpOutput: " << method << " " << target << " -> " << handshake.response.substr(9, 3));
+	return true;
+}
+
+void HttpOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "HttpOutput: output buffer " << mem << " size " << size);
+
+	// The part headers are the same for everyone, so they're shared along with the JPEG.
+	StreamServer::FramePtr frame = server_->GetFrame();
+	char header[128];
+	int n = snprintf(header, sizeof(header), "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+					 BOUNDARY.c_str(), size);
+	frame->header.assign(header, n);
+	frame->data.assign((uint8_t *)mem, (uint8_t *)mem + size);
+	frame->trailer.assign("\r\n");
+	frame->keyframe = flags & FLAG_KEYFRAME;
+	frame->timestamp_us = timestamp_us;
+	server_->Send(frame);
+}
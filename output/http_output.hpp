@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * http_output.hpp - serve MJPEG over HTTP.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "output.hpp"
+#include "stream_server.hpp"
+
+// Serve the JPEGs to any number of browsers as multipart/x-mixed-replace. Clients can ask for a
+// lower frame rate by adding ?fps=<value> to the URL.
+
+class HttpOutput : public Output
+{
+public:
+	HttpOutput(VideoOptions const *options);
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	bool mayBlock() const override { return false; }
+
+private:
+	bool handleRequest(std::string const &request, StreamServer::Handshake &handshake);
+
+	std::string path_;
+	std::unique_ptr<StreamServer> server_;
+};
@@ -0,0 +1,482 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mp4_output.cpp - write H.264 to a fragmented MP4 file.
+ */
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "h264_nal.hpp"
+#include "mp4_output.hpp"
+
+// Sample times are in a 90kHz timescale, like the RTP and MPEG-TS clocks.
+static constexpr uint32_t TIMESCALE = 90000;
+// Fragments get written early if they grow this big, to keep our memory bounded.
+static constexpr size_t MAX_FRAGMENT_SIZE = 8 << 20;
+// The last sample of all needs a duration from somewhere.
+static constexpr uint32_t DEFAULT_DURATION = TIMESCALE / 30;
+
+static constexpr uint32_t SAMPLE_FLAGS_KEYFRAME = 0x02000000;
+static constexpr uint32_t SAMPLE_FLAGS_NON_KEYFRAME = 0x01010000;
+
+namespace
+{
+
+// Appends big-endian values and boxes to a buffer. Boxes get their sizes filled in when they end.
+class BoxWriter
+{
+public:
+	BoxWriter(std::vector<uint8_t> &buf) : buf_(buf) {}
+	void U8(uint8_t value) { buf_.push_back(value); }
+	void U16(uint16_t value) { U8(value >> 8), U8(value); }
+	void U32(uint32_t value) { U16(value >> 16), U16(value); }
+	void U64(uint64_t value) { U32(value >> 32), U32(value); }
+	void Bytes(void const *data, size_t size) { buf_.insert(buf_.end(), (uint8_t *)data, (uint8_t *)data + size); }
+	void Zeros(size_t size) { buf_.insert(buf_.end(), size, 0); }
+	void Matrix()
+	{
+		static constexpr uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+		for (uint32_t value : unity)
+			U32(value);
+	}
+	void Start(char const *type)
+	{
+		starts_.push_back(buf_.size());
+		U32(0);
+		Bytes(type, 4);
+	}
+	void StartFull(char const *type, uint8_t version, uint32_t flags)
+	{
+		Start(type);
+		U32(version << 24 | flags);
+	}
+	void End()
+	{
+		size_t start = starts_.back();
+		starts_.pop_back();
+		Patch32(start, buf_.size() - start);
+	}
+	size_t Pos() const { return buf_.size(); }
+	void Patch32(size_t pos, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++)
+			buf_[pos + i] = value >> (24 - 8 * i);
+	}
+
+private:
+	std::vector<uint8_t> &buf_;
+	std::vector<size_t> starts_;
+};
+
+// Reads the exp-Golomb coded fields of an SPS, once the emulation prevention bytes are gone.
+class BitReader
+{
+public:
+	BitReader(std::vector<uint8_t> const &data) : data_(data), pos_(0) {}
+	unsigned int U(unsigned int bits)
+	{
+		unsigned int value = 0;
+		for (; bits; bits--, pos_++)
+		{
+			if (pos_ >= data_.size() * 8)
+				throw std::runtime_error("H.264 SPS too short");
+			value = (value << 1) | ((data_[pos_ / 8] >> (7 - pos_ % 8)) & 1);
+		}
+		return value;
+	}
+	unsigned int Ue()
+	{
+		unsigned int zeros = 0;
+		while (!U(1))
+			if (++zeros > 31)
+				throw std::runtime_error("bad exp-Golomb code in H.264 SPS");
+		return (1u << zeros) - 1 + U(zeros);
+	}
+	int Se()
+	{
+		unsigned int value = Ue();
+		return value & 1 ? (value + 1) / 2 : -(int)(value / 2);
+	}
+
+private:
+	std::vector<uint8_t> const &data_;
+	size_t pos_;
+};
+
+struct SpsInfo
+{
+	unsigned int chroma_format_idc = 1;
+	unsigned int bit_depth_luma = 8;
+	unsigned int bit_depth_chroma = 8;
+	unsigned int width = 0;
+	unsigned int height = 0;
+};
+
+// We only need the picture size (for the track header) and the chroma format and bit depths
+// (for the avcC box of the high profiles), but we have to go through everything before them.
+SpsInfo parse_sps(std::vector<uint8_t> const &sps)
+{
+	std::vector<uint8_t> rbsp;
+	for (size_t i = 1; i < sps.size(); i++)
+	{
+		if (i >= 3 && sps[i] == 3 && sps[i - 1] == 0 && sps[i - 2] == 0)
+			continue;
+		rbsp.push_back(sps[i]);
+	}
+
+	SpsInfo info;
+	BitReader bits(rbsp);
+	unsigned int profile_idc = bits.U(8);
+	bits.U(16); // constraint flags and level
+	bits.Ue(); // seq_parameter_set_id
+	if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
+		profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || profile_idc == 138 ||
+		profile_idc == 139 || profile_idc == 134 || profile_idc == 135)
+	{
+		info.chroma_format_idc = bits.Ue();
+		if (info.chroma_format_idc == 3)
+			bits.U(1); // separate_colour_plane_flag
+		info.bit_depth_luma = bits.Ue() + 8;
+		info.bit_depth_chroma = bits.Ue() + 8;
+		bits.U(1); // qpprime_y_zero_transform_bypass_flag
+		if (bits.U(1)) // seq_scaling_matrix_present_flag
+		{
+			for (unsigned int i = 0; i < (info.chroma_format_idc != 3 ? 8u : 12u); i++)
+			{
+				if (!bits.U(1))
+					continue;
+				int last_scale = 8, next_scale = 8;
+				for (unsigned int j = 0; j < (i < 6 ? 16u : 64u); j++)
+				{
+					if (next_scale)
+						next_scale = (last_scale + bits.Se() + 256) % 256;
+					last_scale = next_scale ? next_scale : last_scale;
+				}
+			}
+		}
+	}
+	bits.Ue(); // log2_max_frame_num_minus4
+	unsigned int pic_order_cnt_type = bits.Ue();
+	if (pic_order_cnt_type == 0)
+		bits.Ue(); // log2_max_pic_order_cnt_lsb_minus4
+	else if (pic_order_cnt_type == 1)
+	{
+		bits.U(1); // delta_pic_order_always_zero_flag
+		bits.Se(); // offset_for_non_ref_pic
+		bits.Se(); // offset_for_top_to_bottom_field
+		for (unsigned int i = bits.Ue(); i; i--)
+			bits.Se(); // offset_for_ref_frame
+	}
+	bits.Ue(); // max_num_ref_frames
+	bits.U(1); // gaps_in_frame_num_value_allowed_flag
+	unsigned int width_in_mbs = bits.Ue() + 1;
+	unsigned int height_in_map_units = bits.Ue() + 1;
+	unsigned int frame_mbs_only = bits.U(1);
+	if (!frame_mbs_only)
+		bits.U(1); // mb_adaptive_frame_field_flag
+	bits.U(1); // direct_8x8_inference_flag
+	unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+	if (bits.U(1)) // frame_cropping_flag
+	{
+		crop_left = bits.Ue();
+		crop_right = bits.Ue();
+		crop_top = bits.Ue();
+		crop_bottom = bits.Ue();
+	}
+
+	unsigned int crop_unit_x = info.chroma_format_idc == 1 || info.chroma_format_idc == 2 ? 2 : 1;
+	unsigned int crop_unit_y = (info.chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+	info.width = width_in_mbs * 16 - (crop_left + crop_right) * crop_unit_x;
+	info.height = (2 - frame_mbs_only) * height_in_map_units * 16 - (crop_top + crop_bottom) * crop_unit_y;
+	return info;
+}
+
+} // namespace
+
+Mp4Output::Mp4Output(VideoOptions const *options)
+	: Output(options), fd_(-1), header_written_(false), sequence_(0), fragment_start_(0), last_timestamp_(0)
+{
+	if (options->segment || options->split)
+		throw std::runtime_error("mp4 output doesn't support --segment or --split");
+
+	if (options->output == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		fd_ = open(options->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + options->output);
+	}
+	mdat_.reserve(MAX_FRAGMENT_SIZE);
+}
+
+Mp4Output::~Mp4Output()
+{
+	try
+	{
+		if (!samples_.empty())
+		{
+			samples_.back().duration = samples_.size() > 1 ? samples_.end()[-2].duration : DEFAULT_DURATION;
+			writeFragment();
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("Mp4Output: " << e.what());
+	}
+	if (fd_ != STDOUT_FILENO)
+		close(fd_);
+	LOG(2, "Mp4Output: wrote " << sequence_ << " fragments");
+}
+
+void Mp4Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "Mp4Output: output buffer " << mem << " size " << size);
+	uint64_t timestamp = timestamp_us * TIMESCALE / 1000000;
+	bool keyframe = flags & FLAG_KEYFRAME;
+
+	// We only know how long each frame lasts once the next one arrives.
+	if (!samples_.empty())
+	{
+		samples_.back().duration = timestamp > last_timestamp_ ? timestamp - last_timestamp_ : 1;
+
+		// Fragments start on keyframes, unless we were asked for fixed length ones.
+		uint64_t elapsed_ms = (timestamp - fragment_start_) * 1000 / TIMESCALE;
+		bool cut = options_->mp4_fragment ? elapsed_ms >= options_->mp4_fragment : keyframe;
+		if (cut || mdat_.size() + size > MAX_FRAGMENT_SIZE)
+			writeFragment();
+	}
+	if (samples_.empty())
+		fragment_start_ = timestamp;
+	last_timestamp_ = timestamp;
+
+	// The parameter sets go in the moov box, and everything else gets stored with its length
+	// in front, instead of a start code.
+	size_t start = mdat_.size();
+	for_each_nal_unit((uint8_t *)mem, size, [this](uint8_t *nal, size_t nal_size) {
+		int type = nal[0] & 0x1f;
+		if (type == NAL_SPS && sps_.empty())
+			sps_.assign(nal, nal + nal_size);
+		else if (type == NAL_PPS && pps_.empty())
+			pps_.assign(nal, nal + nal_size);
+		if (type == NAL_SPS || type == NAL_PPS || type == NAL_AUD)
+			return;
+		uint8_t length[4] = { (uint8_t)(nal_size >> 24), (uint8_t)(nal_size >> 16), (uint8_t)(nal_size >> 8),
+							  (uint8_t)nal_size };
+		mdat_.insert(mdat_.end(), length, length + 4);
+		mdat_.insert(mdat_.end(), nal, nal + nal_size);
+	});
+	samples_.push_back({ (uint32_t)(mdat_.size() - start), 0, keyframe });
+
+	if (!header_written_ && !sps_.empty() && !pps_.empty())
+		writeHeader();
+}
+
+void Mp4Output::writeHeader()
+{
+	SpsInfo info = parse_sps(sps_);
+	LOG(2, "Mp4Output: H.264 stream is " << info.width << "x" << info.height);
+
+	std::vector<uint8_t> header;
+	BoxWriter box(header);
+
+	box.Start("ftyp");
+	box.Bytes("isom", 4);
+	box.U32(0x200);
+	box.Bytes("isomiso5avc1mp41", 16);
+	box.End();
+
+	box.Start("moov");
+	box.StartFull("mvhd", 0, 0);
+	box.U32(0); // creation time
+	box.U32(0); // modification time
+	box.U32(1000); // timescale
+	box.U32(0); // duration, which is all in the fragments
+	box.U32(0x00010000); // rate
+	box.U16(0x0100); // volume
+	box.Zeros(10);
+	box.Matrix();
+	box.Zeros(24);
+	box.U32(2); // next track id
+	box.End();
+
+	box.Start("trak");
+	box.StartFull("tkhd", 0, 3); // enabled and in the movie
+	box.U32(0); // creation time
+	box.U32(0); // modification time
+	box.U32(1); // track id
+	box.U32(0);
+	box.U32(0); // duration
+	box.Zeros(8);
+	box.U16(0); // layer
+	box.U16(0); // alternate group
+	box.U16(0); // volume
+	box.U16(0);
+	box.Matrix();
+	box.U32(info.width << 16);
+	box.U32(info.height << 16);
+	box.End();
+
+	box.Start("mdia");
+	box.StartFull("mdhd", 0, 0);
+	box.U32(0); // creation time
+	box.U32(0); // modification time
+	box.U32(TIMESCALE);
+	box.U32(0); // duration
+	box.U16(0x55c4); // language "und"
+	box.U16(0);
+	box.End();
+	box.StartFull("hdlr", 0, 0);
+	box.U32(0);
+	box.Bytes("vide", 4);
+	box.Zeros(12);
+	box.Bytes("VideoHandler", 13);
+	box.End();
+
+	box.Start("minf");
+	box.StartFull("vmhd", 0, 1);
+	box.Zeros(8); // graphics mode and colour
+	box.End();
+	box.Start("dinf");
+	box.StartFull("dref", 0, 0);
+	box.U32(1);
+	box.StartFull("url ", 0, 1); // the data is in this file
+	box.End();
+	box.End();
+	box.End();
+
+	box.Start("stbl");
+	box.StartFull("stsd", 0, 0);
+	box.U32(1);
+	box.Start("avc1");
+	box.Zeros(6);
+	box.U16(1); // data reference index
+	box.Zeros(16);
+	box.U16(info.width);
+	box.U16(info.height);
+	box.U32(0x00480000); // 72dpi
+	box.U32(0x00480000);
+	box.U32(0);
+	box.U16(1); // frame count
+	box.Zeros(32); // compressor name
+	box.U16(0x0018); // depth
+	box.U16(0xffff);
+	box.Start("avcC");
+	box.U8(1); // version
+	box.Bytes(&sps_[1], 3); // profile, compatibility and level
+	box.U8(0xff); // 4 byte NAL unit lengths
+	box.U8(0xe1); // 1 SPS
+	box.U16(sps_.size());
+	box.Bytes(sps_.data(), sps_.size());
+	box.U8(1); // 1 PPS
+	box.U16(pps_.size());
+	box.Bytes(pps_.data(), pps_.size());
+	if (sps_[1] == 100 || sps_[1] == 110 || sps_[1] == 122 || sps_[1] == 244)
+	{
+		box.U8(0xfc | info.chroma_format_idc);
+		box.U8(0xf8 | (info.bit_depth_luma - 8));
+		box.U8(0xf8 | (info.bit_depth_chroma - 8));
+		box.U8(0); // no SPS extensions
+	}
+	box.End();
+	box.End();
+	box.End();
+	// The samples are all described in the fragments, so these tables stay empty.
+	for (char const *type : { "stts", "stsc", "stco" })
+	{
+		box.StartFull(type, 0, 0);
+		box.U32(0);
+		box.End();
+	}
+	box.StartFull("stsz", 0, 0);
+	box.U32(0);
+	box.U32(0);
+	box.End();
+	box.End(); // stbl
+	box.End(); // minf
+	box.End(); // mdia
+	box.End(); // trak
+
+	box.Start("mvex");
+	box.StartFull("trex", 0, 0);
+	box.U32(1); // track id
+	box.U32(1); // sample description index
+	box.U32(0); // duration
+	box.U32(0); // size
+	box.U32(0); // flags
+	box.End();
+	box.End();
+	box.End(); // moov
+
+	writeBuffers(header, {});
+	header_written_ = true;
+}
+
+void Mp4Output::writeFragment()
+{
+	if (!header_written_)
+		throw std::runtime_error("no SPS and PPS found in H.264 stream");
+
+	moof_.clear();
+	BoxWriter box(moof_);
+	box.Start("moof");
+	box.StartFull("mfhd", 0, 0);
+	box.U32(++sequence_);
+	box.End();
+	box.Start("traf");
+	box.StartFull("tfhd", 0, 0x020000); // offsets are from the start of the moof
+	box.U32(1); // track id
+	box.End();
+	box.StartFull("tfdt", 1, 0);
+	box.U64(fragment_start_);
+	box.End();
+	// Every sample has its own duration, size and flags, and there's an offset to the data.
+	box.StartFull("trun", 0, 0x000701);
+	box.U32(samples_.size());
+	size_t data_offset = box.Pos();
+	box.U32(0);
+	for (Sample const &sample : samples_)
+	{
+		box.U32(sample.duration);
+		box.U32(sample.size);
+		box.U32(sample.keyframe ? SAMPLE_FLAGS_KEYFRAME : SAMPLE_FLAGS_NON_KEYFRAME);
+	}
+	box.End();
+	box.End(); // traf
+	box.End(); // moof
+
+	// The mdat header goes on the end of the moof, and the data follows straight after.
+	box.Patch32(data_offset, moof_.size() + 8);
+	box.U32(8 + mdat_.size());
+	box.Bytes("mdat", 4);
+
+	writeBuffers(moof_, mdat_);
+	samples_.clear();
+	mdat_.clear();
+}
+
+void Mp4Output::writeBuffers(std::vector<uint8_t> const &buf1, std::vector<uint8_t> const &buf2)
+{
+	struct iovec iov[2] = { { (void *)buf1.data(), buf1.size() }, { (void *)buf2.data(), buf2.size() } };
+	int num = buf2.empty() ? 1 : 2;
+	for (int i = 0; i < num;)
+	{
+		ssize_t n = writev(fd_, iov + i, num - i);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error("failed to write output bytes");
+		for (; i < num && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (i < num)
+		{
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
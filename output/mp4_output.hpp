@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mp4_output.hpp - write H.264 to a fragmented MP4 file.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "output.hpp"
+
+// The moov box goes at the start of the file as soon as we've seen the SPS and PPS, and after
+// that each fragment (a moof and mdat box) is written out as it completes. Every fragment that
+// makes it to the file is playable, even if we never get to finish properly.
+
+class Mp4Output : public Output
+{
+public:
+	Mp4Output(VideoOptions const *options);
+	~Mp4Output();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void writeHeader();
+	void writeFragment();
+	void writeBuffers(std::vector<uint8_t> const &buf1, std::vector<uint8_t> const &buf2);
+
+	int fd_;
+	std::vector<uint8_t> sps_;
+	std::vector<uint8_t> pps_;
+	bool header_written_;
+	uint32_t sequence_;
+
+	// The frames of the fragment we're building, with their NAL units stored one after another
+	// in mdat_ (each preceded by its length).
+	struct Sample
+	{
+		uint32_t size;
+		uint32_t duration;
+		bool keyframe;
+	};
+	std::vector<Sample> samples_;
+	std::vector<uint8_t> mdat_;
+	std::vector<uint8_t> moof_;
+	uint64_t fragment_start_;
+	uint64_t last_timestamp_;
+};
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * multi_output.cpp - send the same encoded stream to several outputs.
+ */
+
+#include "multi_output.hpp"
+
+// Most encoded data we queue for any one output before it has to skip frames.
+static constexpr size_t SINK_QUEUE_SIZE = 16 << 20;
+// Buffers we keep for reuse, once every output has finished with them.
+static constexpr unsigned int BUFFER_POOL_SIZE = 32;
+
+MultiOutput::MultiOutput(VideoOptions const *options) : Output(options), abort_(false)
+{
+	// Each output gets options of its own, without the things that we do for all of them.
+	for (std::string const &output : options->outputs)
+	{
+		std::unique_ptr<Sink> sink = std::make_unique<Sink>();
+		sink->options = std::make_unique<VideoOptions>(*options);
+		sink->options->output = output;
+		sink->options->outputs = { output };
+		sink->options->pause = false;
+		sink->options->save_pts.clear();
+		sink->options->metadata.clear();
+		sink->output = std::unique_ptr<Output>(Output::Create(sink->options.get()));
+		sink->threaded = sink->output->mayBlock();
+		sinks_.push_back(std::move(sink));
+	}
+
+	for (auto &sink : sinks_)
+	{
+		if (sink->threaded)
+			sink->thread = std::thread(&MultiOutput::sinkThread, this, std::ref(*sink));
+	}
+}
+
+MultiOutput::~MultiOutput()
+{
+	// The outputs get to finish everything that's queued for them.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	for (auto &sink : sinks_)
+	{
+		if (!sink->threaded)
+			continue;
+		sink->cond_var.notify_one();
+		sink->thread.join();
+		if (sink->resyncs)
+			LOG(1, "MultiOutput: " << sink->options->output << " skipped frames " << sink->resyncs << " times");
+	}
+}
+
+void MultiOutput::Signal()
+{
+	// With --circular, a signal means save the buffer, which each output does for itself. Otherwise
+	// they all pause and resume together.
+	if (options_->circular)
+	{
+		for (auto &sink : sinks_)
+			sink->output->Signal();
+	}
+	else
+		Output::Signal();
+}
+
+bool MultiOutput::KeyframeWanted()
+{
+	bool wanted = Output::KeyframeWanted();
+	for (auto &sink : sinks_)
+		wanted = sink->output->KeyframeWanted() || wanted;
+	return wanted;
+}
+
+MultiOutput::BufferPtr MultiOutput::getBuffer()
+{
+	// Only the pool refers to a buffer once every output has finished with it.
+	for (BufferPtr &buffer : buffer_pool_)
+	{
+		if (buffer.use_count() == 1)
+			return buffer;
+	}
+	BufferPtr buffer = std::make_shared<Buffer>();
+	if (buffer_pool_.size() < BUFFER_POOL_SIZE)
+		buffer_pool_.push_back(buffer);
+	return buffer;
+}
+
+void MultiOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "MultiOutput: output buffer " << mem << " size " << size);
+	unsigned int working = 0;
+
+	// Outputs that don't block take the encoder's buffer as it is.
+	for (auto &sink : sinks_)
+	{
+		if (sink->threaded || sink->failed)
+			continue;
+		try
+		{
+			sink->output->outputBuffer(mem, size, timestamp_us, flags);
+			working++;
+		}
+		catch (std::exception const &e)
+		{
+			sinkFailed(*sink, e);
+		}
+	}
+
+	// The rest share a copy, which we only make if one of them wants it.
+	BufferPtr buffer;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &sink : sinks_)
+	{
+		if (!sink->threaded || sink->failed)
+			continue;
+		working++;
+
+		if (sink->resyncing && (flags & FLAG_KEYFRAME))
+			sink->resyncing = false;
+		else if (!sink->resyncing && !sink->queue.empty() && sink->queued_bytes + size > SINK_QUEUE_SIZE)
+		{
+			if (!sink->resyncs++)
+				LOG(1, "MultiOutput: " << sink->options->output << " is falling behind, skipping frames");
+			sink->resyncing = true;
+			requestKeyframe();
+		}
+		if (sink->resyncing)
+			continue;
+
+		if (!buffer)
+		{
+			buffer = getBuffer();
+			buffer->data.assign((uint8_t *)mem, (uint8_t *)mem + size);
+			buffer->timestamp_us = timestamp_us;
+			buffer->flags = flags;
+		}
+		sink->queue.push_back(buffer);
+		sink->queued_bytes += size;
+		sink->cond_var.notify_one();
+	}
+
+	if (!working)
+		throw std::runtime_error("MultiOutput: all outputs have failed");
+}
+
+void MultiOutput::sinkFailed(Sink &sink, std::exception const &e)
+{
+	// Threaded outputs call this with the lock held.
+	LOG_ERROR("MultiOutput: dropping output " << sink.options->output << ": " << e.what());
+	sink.failed = true;
+	sink.queue.clear();
+	sink.queued_bytes = 0;
+}
+
+void MultiOutput::sinkThread(Sink &sink)
+{
+	while (true)
+	{
+		BufferPtr buffer;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			sink.cond_var.wait(lock, [&] { return abort_ || !sink.queue.empty(); });
+			if (sink.queue.empty())
+				return;
+			buffer = sink.queue.front();
+			sink.queue.pop_front();
+		}
+
+		try
+		{
+			sink.output->outputBuffer(buffer->data.data(), buffer->data.size(), buffer->timestamp_us, buffer->flags);
+		}
+		catch (std::exception const &e)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			sinkFailed(sink, e);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		sink.queued_bytes -= buffer->data.size();
+	}
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * multi_output.hpp - send the same encoded stream to several outputs.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// We look after pausing, timestamps and metadata for all the outputs, which get the buffers that
+// we let through. Outputs that never block (servers, the circular buffer) already copy what they
+// need, so they get the encoder's buffer straight away. Each of the others (including files, which
+// wait once all their write blocks are full) has its own thread and queue, so a slow one doesn't
+// hold up the encoder or the rest. The encoder needs its buffer back once we return, so for those
+// it gets copied, but just the once, with the copy shared by all the queues. An output that fails
+// is dropped, and the others carry on.
+
+class MultiOutput : public Output
+{
+public:
+	MultiOutput(VideoOptions const *options);
+	~MultiOutput();
+	void Signal() override;
+	bool KeyframeWanted() override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Buffer
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us;
+		uint32_t flags;
+	};
+	using BufferPtr = std::shared_ptr<Buffer>;
+
+	struct Sink
+	{
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Output> output;
+		// Outputs that may block get a thread of their own, and a queue of buffers for it.
+		bool threaded = false;
+		std::deque<BufferPtr> queue;
+		size_t queued_bytes = 0;
+		// An output that falls too far behind skips to the next keyframe.
+		bool resyncing = false;
+		unsigned int resyncs = 0;
+		bool failed = false;
+		std::condition_variable cond_var;
+		std::thread thread;
+	};
+
+	BufferPtr getBuffer();
+	void sinkFailed(Sink &sink, std::exception const &e);
+	void sinkThread(Sink &sink);
+
+	std::vector<std::unique_ptr<Sink>> sinks_;
+	std::vector<BufferPtr> buffer_pool_;
+	std::mutex mutex_;
+	bool abort_;
+};
@@ -8,9 +8,28 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include <random>
+#include <thread>
+
+#include "h264_nal.hpp"
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+// RTP packets carry this (dynamic) payload type, and H.264 timestamps run at 90kHz.
+static constexpr uint8_t RTP_PAYLOAD_TYPE = 96;
+static constexpr unsigned int RTP_CLOCK = 90000;
+// The IP, UDP and RTP headers all have to fit within the MTU.
+static constexpr size_t RTP_OVERHEAD = 20 + 8 + 12;
+// Datagrams get sent this many at a time.
+static constexpr unsigned int SEND_BATCH = 32;
+// MPEG-TS goes over udp as 7 packets to a datagram, which fits in the usual MTU.
+static constexpr size_t TS_DATAGRAM_SIZE = 7 * TsMuxer::PACKET_SIZE;
+// Most encoded data we queue for any one tcp client before it has to skip frames.
+static constexpr size_t CLIENT_QUEUE_SIZE = 8 << 20;
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), fd_(-1), rtp_(false), rtp_payload_size_(0), rtp_sequence_(0), rtp_ssrc_(0),
+	  rtp_timestamp_base_(0), rtp_num_packets_(0), iov_(2 * SEND_BATCH), msgs_(SEND_BATCH),
+	  rtp_pacing_(options->rtp_pacing)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -18,7 +37,7 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->output);
 	std::string address = options->output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "udp") == 0 || strcmp(protocol, "rtp") == 0)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -32,37 +51,32 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+		if (strcmp(protocol, "rtp") == 0)
+		{
+			if (options->codec != "h264")
+				throw std::runtime_error("rtp output only supports the h264 codec");
+			if (options->rtp_mtu < RTP_OVERHEAD + 100)
+				throw std::runtime_error("rtp mtu too small");
+			rtp_ = true;
+			rtp_payload_size_ = options->rtp_mtu - RTP_OVERHEAD;
+			std::random_device random;
+			rtp_sequence_ = random();
+			rtp_ssrc_ = random();
+			rtp_timestamp_base_ = random();
+			LOG(2, "NetOutput: RTP session description:\n"
+					   << "v=0\no=- 0 0 IN IP4 127.0.0.1\ns=libcamera-vid\nc=IN IP4 " << address << "\nt=0 0\nm=video "
+					   << port << " RTP/AVP " << (int)RTP_PAYLOAD_TYPE << "\na=rtpmap:" << (int)RTP_PAYLOAD_TYPE
+					   << " H264/" << RTP_CLOCK << "\na=fmtp:" << (int)RTP_PAYLOAD_TYPE << " packetization-mode=1");
+		}
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
 		if (options->listen)
 		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-				throw std::runtime_error("failed to setsockopt listen socket");
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
+			// We are the server. Clients can come and go, and each starts at the next keyframe.
+			server_ = std::make_unique<StreamServer>("NetOutput", port, CLIENT_QUEUE_SIZE, nullptr,
+													 [this]() { requestKeyframe(); });
 		}
 		else
 		{
@@ -88,21 +102,69 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->output);
+
+	if (options->mpegts)
+	{
+		if (rtp_)
+			throw std::runtime_error("rtp output doesn't support --mpegts");
+		ts_ = std::make_unique<TsMuxer>(SEND_BATCH * TS_DATAGRAM_SIZE / TsMuxer::PACKET_SIZE,
+										[this](uint8_t *data, size_t size) { send(data, size); });
+	}
 }
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (fd_ >= 0)
+		close(fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
+	if (rtp_)
+	{
+		rtpFrame((uint8_t *)mem, size, timestamp_us);
+		return;
+	}
+	if (server_)
+	{
+		// The frame gets copied once, and then shared by all the clients.
+		frame_ = server_->GetFrame();
+		frame_->data.clear();
+		frame_->keyframe = flags & FLAG_KEYFRAME;
+		frame_->timestamp_us = timestamp_us;
+	}
+
+	if (ts_)
+		ts_->Mux((uint8_t *)mem, size, timestamp_us, flags & FLAG_KEYFRAME);
+	else
+		send((uint8_t *)mem, size);
+
+	if (server_)
+	{
+		server_->Send(frame_);
+		frame_.reset();
+	}
+}
+
+void NetOutput::send(uint8_t *data, size_t size)
+{
+	if (server_)
+	{
+		frame_->data.insert(frame_->data.end(), data, data + size);
+		return;
+	}
+	if (ts_ && saddr_ptr_)
+	{
+		sendDatagrams(data, size, TS_DATAGRAM_SIZE);
+		return;
+	}
+
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+	for (uint8_t *ptr = data; size;)
 	{
 		size_t bytes_to_send = std::min(size, max_size);
 		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
@@ -111,3 +173,127 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
 		size -= bytes_to_send;
 	}
 }
+
+void NetOutput::sendDatagrams(uint8_t *data, size_t size, size_t datagram_size)
+{
+	while (size)
+	{
+		unsigned int n = 0;
+		for (size_t offset = 0; n < SEND_BATCH && offset < size; n++, offset += datagram_size)
+		{
+			iov_[n] = { data + offset, std::min(datagram_size, size - offset) };
+			msgs_[n] = {};
+			msgs_[n].msg_hdr.msg_name = (void *)saddr_ptr_;
+			msgs_[n].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs_[n].msg_hdr.msg_iov = &iov_[n];
+			msgs_[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = sendmmsg(fd_, msgs_.data(), n, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			throw std::runtime_error("failed to send data on socket");
+		size_t bytes = std::min(sent * datagram_size, size);
+		data += bytes;
+		size -= bytes;
+	}
+}
+
+void NetOutput::rtpFrame(uint8_t *mem, size_t size, int64_t timestamp_us)
+{
+	uint32_t timestamp = rtp_timestamp_base_ + (uint32_t)(timestamp_us * RTP_CLOCK / 1000000);
+
+	for_each_nal_unit(mem, size, [this, timestamp](uint8_t *nal, size_t nal_size) {
+		rtpNalUnit(nal, nal_size, timestamp);
+	});
+
+	// The marker bit goes on the last packet of the frame.
+	if (rtp_num_packets_)
+	{
+		rtp_packets_[rtp_num_packets_ - 1].header[1] |= 0x80;
+		rtpSend();
+	}
+}
+
+void NetOutput::rtpNalUnit(uint8_t *nal, size_t size, uint32_t timestamp)
+{
+	if (size <= rtp_payload_size_)
+	{
+		rtpPacket(nullptr, 0, nal, size, timestamp);
+		return;
+	}
+
+	// Too big for one packet, so send FU-A fragments. The NAL unit header is replaced by the
+	// FU indicator and FU header, which mark the first and last fragments.
+	uint8_t fu[2] = { (uint8_t)((nal[0] & 0xe0) | 28), (uint8_t)(0x80 | (nal[0] & 0x1f)) };
+	nal++, size--;
+	while (size)
+	{
+		size_t n = std::min(size, rtp_payload_size_ - sizeof(fu));
+		if (n == size)
+			fu[1] |= 0x40;
+		rtpPacket(fu, sizeof(fu), nal, n, timestamp);
+		fu[1] &= ~0x80;
+		nal += n;
+		size -= n;
+	}
+}
+
+void NetOutput::rtpPacket(uint8_t const *header, size_t header_size, uint8_t *payload, size_t size, uint32_t timestamp)
+{
+	if (rtp_num_packets_ == rtp_packets_.size())
+		rtp_packets_.emplace_back();
+	RtpPacket &packet = rtp_packets_[rtp_num_packets_++];
+
+	uint8_t *h = packet.header;
+	h[0] = 0x80; // version 2
+	h[1] = RTP_PAYLOAD_TYPE;
+	h[2] = rtp_sequence_ >> 8, h[3] = rtp_sequence_;
+	h[4] = timestamp >> 24, h[5] = timestamp >> 16, h[6] = timestamp >> 8, h[7] = timestamp;
+	h[8] = rtp_ssrc_ >> 24, h[9] = rtp_ssrc_ >> 16, h[10] = rtp_ssrc_ >> 8, h[11] = rtp_ssrc_;
+	memcpy(h + 12, header, header_size);
+	packet.header_size = 12 + header_size;
+	packet.payload = payload;
+	packet.size = size;
+	rtp_sequence_++;
+}
+
+void NetOutput::rtpSend()
+{
+	for (unsigned int done = 0; done < rtp_num_packets_;)
+	{
+		unsigned int n = std::min(rtp_num_packets_ - done, SEND_BATCH);
+		for (unsigned int i = 0; i < n; i++)
+		{
+			RtpPacket &packet = rtp_packets_[done + i];
+			iov_[2 * i] = { packet.header, packet.header_size };
+			iov_[2 * i + 1] = { packet.payload, packet.size };
+			msgs_[i] = {};
+			msgs_[i].msg_hdr.msg_name = (void *)saddr_ptr_;
+			msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs_[i].msg_hdr.msg_iov = &iov_[2 * i];
+			msgs_[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		// With pacing, each batch waits until the previous ones would have gone out at the given rate.
+		if (rtp_pacing_)
+			std::this_thread::sleep_until(rtp_next_send_);
+		int sent = sendmmsg(fd_, msgs_.data(), n, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			throw std::runtime_error("failed to send data on socket");
+
+		if (rtp_pacing_)
+		{
+			size_t bits = 0;
+			for (int i = 0; i < sent; i++)
+				bits += (msgs_[i].msg_len + RTP_OVERHEAD - 12) * 8;
+			rtp_next_send_ = std::max(rtp_next_send_, std::chrono::steady_clock::now()) +
+							 std::chrono::nanoseconds(bits * 1000000000ULL / rtp_pacing_);
+		}
+		done += sent;
+	}
+	rtp_num_packets_ = 0;
+}
@@ -8,8 +8,16 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "output.hpp"
+#include "stream_server.hpp"
+#include "ts_muxer.hpp"
 
 class NetOutput : public Output
 {
@@ -19,10 +27,47 @@ public:
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	// Only the server has threads of its own to send with.
+	bool mayBlock() const override { return !server_; }
 
 private:
+	void send(uint8_t *data, size_t size);
+	void sendDatagrams(uint8_t *data, size_t size, size_t datagram_size);
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	// When listening, a server thread looks after any number of clients.
+	std::unique_ptr<StreamServer> server_;
+	StreamServer::FramePtr frame_;
+	// With --mpegts, frames are wrapped in a transport stream before we send them.
+	std::unique_ptr<TsMuxer> ts_;
+
+	// For rtp:// we send H.264 as RTP packets (RFC 6184), with large NAL units split into
+	// fragmentation units. The packets of a frame go out in batches with sendmmsg.
+	void rtpFrame(uint8_t *mem, size_t size, int64_t timestamp_us);
+	void rtpNalUnit(uint8_t *nal, size_t size, uint32_t timestamp);
+	void rtpPacket(uint8_t const *header, size_t header_size, uint8_t *payload, size_t size, uint32_t timestamp);
+	void rtpSend();
+	bool rtp_;
+	size_t rtp_payload_size_;
+	uint16_t rtp_sequence_;
+	uint32_t rtp_ssrc_;
+	uint32_t rtp_timestamp_base_;
+	// Packets only point at the encoded data; their RTP and fragmentation headers live here.
+	struct RtpPacket
+	{
+		uint8_t header[14];
+		size_t header_size;
+		uint8_t *payload;
+		size_t size;
+	};
+	std::vector<RtpPacket> rtp_packets_;
+	unsigned int rtp_num_packets_;
+	// Space for sendmmsg to send a batch of RTP or MPEG-TS datagrams.
+	std::vector<struct iovec> iov_;
+	std::vector<struct mmsghdr> msgs_;
+	uint32_t rtp_pacing_;
+	std::chrono::steady_clock::time_point rtp_next_send_;
 };
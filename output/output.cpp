@@ -10,12 +10,15 @@
 
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "http_output.hpp"
+#include "mp4_output.hpp"
+#include "multi_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
 	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
-	  buf_metadata_(std::cout.rdbuf()), of_metadata_()
+	  keyframe_wanted_(false), buf_metadata_(std::cout.rdbuf()), of_metadata_(), quality_(-1)
 {
 	if (!options->save_pts.empty())
 	{
@@ -50,6 +53,9 @@ Output::~Output()
 void Output::Signal()
 {
 	enable_ = !enable_;
+	// Don't wait for the encoder's next keyframe before recording resumes.
+	if (enable_)
+		requestKeyframe();
 }
 
 void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
@@ -63,7 +69,10 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	if (state_ == WAITING_KEYFRAME && keyframe)
 		state_ = RUNNING, flags |= FLAG_RESTART;
 	if (state_ != RUNNING)
+	{
+		outputMetadata(timestamp_us, false);
 		return;
+	}
 
 	// Frig the timestamps to be continuous after a pause.
 	if (flags & FLAG_RESTART)
@@ -78,13 +87,23 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		timestampReady(last_timestamp_);
 	}
 
-	if (!options_->metadata.empty())
+	outputMetadata(timestamp_us, true);
+}
+
+void Output::outputMetadata(int64_t timestamp_us, bool write)
+{
+	if (options_->metadata.empty())
+		return;
+
+	// Anything older than this frame belongs to frames that the encoder dropped.
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	auto it = metadata_.find(timestamp_us);
+	if (write && it != metadata_.end())
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->metadata_format, metadata, !metadata_started_);
+		write_metadata(buf_metadata_, options_->metadata_format, it->second, !metadata_started_, quality_);
 		metadata_started_ = true;
-		metadata_queue_.pop();
 	}
+	metadata_.erase(metadata_.begin(), metadata_.upper_bound(timestamp_us));
 }
 
 void Output::timestampReady(int64_t timestamp)
@@ -104,22 +123,37 @@ Output *Output::Create(VideoOptions const *options)
 	if (options->codec == "libav")
 		return new Output(options);
 
-	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
+	if (options->outputs.size() > 1)
+		return new MultiOutput(options);
+
+	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 ||
+		strncmp(options->output.c_str(), "rtp://", 6) == 0)
 		return new NetOutput(options);
+	else if (strncmp(options->output.c_str(), "http://", 7) == 0)
+		return new HttpOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
+	else if (options->codec == "h264" && !options->mpegts && options->output.size() > 4 &&
+			 options->output.compare(options->output.size() - 4, 4, ".mp4") == 0)
+		return new Mp4Output(options);
 	else if (!options->output.empty())
 		return new FileOutput(options);
 	else
 		return new Output(options);
 }
 
-void Output::MetadataReady(libcamera::ControlList &metadata)
+void Output::QualityReady(int quality)
+{
+	quality_ = quality;
+}
+
+void Output::MetadataReady(libcamera::ControlList &metadata, int64_t timestamp_us)
 {
 	if (options_->metadata.empty())
 		return;
 
-	metadata_queue_.push(metadata);
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	metadata_[timestamp_us] = metadata;
 }
 
 void start_metadata_output(std::streambuf *buf, std::string fmt)
@@ -129,14 +163,18 @@ void start_metadata_output(std::streambuf *buf, std::string fmt)
 		out << "[" << std::endl;
 }
 
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write)
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write,
+					int quality)
 {
+	// The encoder's quality isn't a libcamera control, but it's useful to have it alongside.
 	std::ostream out(buf);
 	const libcamera::ControlIdMap *id_map = metadata.idMap();
 	if (fmt == "txt")
 	{
 		for (auto const &[id, val] : metadata)
 			out << id_map->at(id)->name() << "=" << val.toString() << std::endl;
+		if (quality >= 0)
+			out << "EncoderQuality=" << quality << std::endl;
 		out << std::endl;
 	}
 	else
@@ -152,6 +190,8 @@ void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList
 				<< "    \"" << id_map->at(id)->name() << "\": " << arg_quote << val.toString() << arg_quote;
 			first_done = true;
 		}
+		if (quality >= 0)
+			out << (first_done ? "," : "") << std::endl << "    \"EncoderQuality\": " << quality;
 		out << std::endl << "}";
 	}
 }
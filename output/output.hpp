@@ -10,6 +10,8 @@
 #include <cstdio>
 
 #include <atomic>
+#include <map>
+#include <mutex>
 
 #include "core/video_options.hpp"
 
@@ -22,9 +24,17 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	// Metadata for the frame with this timestamp, which will be written when that frame is output.
+	void MetadataReady(libcamera::ControlList &metadata, int64_t timestamp_us);
+	// The encoder's quality setting for the next buffer to be output, if it has one.
+	void QualityReady(int quality);
+	// Returns true, just the once, when the output would like the encoder to produce a keyframe
+	// as soon as it can, for example to start a new file.
+	virtual bool KeyframeWanted() { return keyframe_wanted_.exchange(false); }
 
 protected:
+	// A MultiOutput passes buffers straight to the outputs it contains.
+	friend class MultiOutput;
 	enum Flag
 	{
 		FLAG_NONE = 0,
@@ -33,6 +43,10 @@ protected:
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
 	virtual void timestampReady(int64_t timestamp);
+	// Whether outputBuffer might wait for the disk or network. Outputs that only copy the data
+	// and leave the rest to threads of their own say not.
+	virtual bool mayBlock() const { return true; }
+	void requestKeyframe() { keyframe_wanted_ = true; }
 	VideoOptions const *options_;
 	FILE *fp_timestamps_;
 
@@ -47,12 +61,18 @@ private:
 	std::atomic<bool> enable_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
+	std::atomic<bool> keyframe_wanted_;
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
 	bool metadata_started_ = false;
-	std::queue<libcamera::ControlList> metadata_queue_;
+	// Frames may be dropped, so each one's metadata is found by timestamp.
+	void outputMetadata(int64_t timestamp_us, bool write);
+	std::map<int64_t, libcamera::ControlList> metadata_;
+	std::mutex metadata_mutex_;
+	int quality_;
 };
 
 void start_metadata_output(std::streambuf *buf, std::string fmt);
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write,
+					int quality = -1);
 void stop_metadata_output(std::streambuf *buf, std::string fmt);
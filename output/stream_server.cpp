@@ -0,0 +1,399 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * stream_server.cpp - serve a stream of frames to any number of network clients.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "stream_server.hpp"
+
+// Most iovecs we hand to a single sendmsg.
+static constexpr unsigned int MAX_IOV = 64;
+// Clients that have data waiting but take none of it for this long are dropped.
+static constexpr std::chrono::seconds CLIENT_TIMEOUT(5);
+// We don't keep more spare frames than this.
+static constexpr unsigned int FRAME_POOL_SIZE = 32;
+
+StreamServer::StreamServer(std::string const &name, int port, size_t max_queue, RequestHandler request_handler,
+						   ClientCallback client_callback)
+	: name_(name), max_queue_(max_queue), request_handler_(request_handler), client_callback_(client_callback),
+	  listen_fd_(-1), epoll_fd_(-1), event_fd_(-1), abort_(false)
+{
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+	if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, SOMAXCONN) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create server events");
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event);
+	event.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+
+	server_thread_ = std::thread(&StreamServer::serverThread, this);
+	LOG(2, name_ << ": listening on port " << port);
+}
+
+StreamServer::~StreamServer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG_ERROR(name_ << ": failed to wake server thread");
+	server_thread_.join();
+
+	while (!clients_.empty())
+		closeClient(clients_.begin()->first);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+StreamServer::FramePtr StreamServer::GetFrame()
+{
+	// Only the pool refers to a frame once every client has finished with it.
+	for (FramePtr &frame : frame_pool_)
+	{
+		if (frame.use_count() == 1)
+		{
+			frame->header.clear();
+			frame->trailer.clear();
+			return frame;
+		}
+	}
+	FramePtr frame = std::make_shared<Frame>();
+	if (frame_pool_.size() < FRAME_POOL_SIZE)
+		frame_pool_.push_back(frame);
+	return frame;
+}
+
+void StreamServer::Send(FramePtr const &frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_.push_back(frame);
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG_ERROR(name_ << ": failed to wake server thread");
+}
+
+void StreamServer::queueFrame(FramePtr const &frame)
+{
+	for (auto &[fd, client] : clients_)
+	{
+		if (!client->ready || client->close)
+			continue;
+		// A frame that's only a little early will do, so that a limit that divides into the camera's
+		// frame rate isn't missed by a few microseconds every time.
+		if (frame->timestamp_us < client->next_timestamp_us - client->min_interval_us / 8)
+			continue;
+
+		// A client that's too far behind loses everything it hasn't started sending, and
+		// picks up again at the next keyframe.
+		if (client->queued_bytes + frame->Size() > max_queue_ && !client->waiting_keyframe)
+		{
+			size_t keep = client->offset && !client->queue.empty() ? 1 : 0;
+			while (client->queue.size() > keep)
+			{
+				client->queued_bytes -= client->queue.back()->Size();
+				client->queue.pop_back();
+			}
+			client->waiting_keyframe = true;
+			if (!client->resyncs++)
+				LOG(1, name_ << ": client " << client->address << " is falling behind, skipping frames");
+		}
+		if (client->waiting_keyframe && !frame->keyframe)
+			continue;
+		if (client->queued_bytes + frame->Size() > max_queue_ && client->queued_bytes)
+			continue;
+
+		client->waiting_keyframe = false;
+		if (client->queue.empty())
+			client->last_progress = std::chrono::steady_clock::now();
+		client->queue.push_back(frame);
+		client->queued_bytes += frame->Size();
+		// Frames won't arrive exactly when they're due, so we keep to the average rate, unless
+		// we've fallen a whole frame behind.
+		if (client->min_interval_us)
+		{
+			client->next_timestamp_us += client->min_interval_us;
+			if (client->next_timestamp_us <= frame->timestamp_us)
+				client->next_timestamp_us = frame->timestamp_us + client->min_interval_us;
+		}
+	}
+}
+
+void StreamServer::serverThread()
+{
+	epoll_event events[16];
+	std::vector<FramePtr> frames;
+	while (true)
+	{
+		int num = epoll_wait(epoll_fd_, events, 16, 1000);
+		if (num < 0 && errno != EINTR)
+		{
+			LOG_ERROR(name_ << ": epoll_wait failed: " << strerror(errno));
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (abort_)
+				return;
+			frames.swap(pending_);
+		}
+		for (FramePtr const &frame : frames)
+			queueFrame(frame);
+		bool wake = !frames.empty();
+		frames.clear();
+
+		for (int i = 0; i < num; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0)
+					LOG_ERROR(name_ << ": failed to read server event");
+			}
+			else
+			{
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				Client &client = *it->second;
+				bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+				if (ok && (events[i].events & EPOLLIN))
+					ok = readClient(client);
+				if (ok && (events[i].events & EPOLLOUT))
+				{
+					setBlocked(client, false);
+					ok = sendClient(client);
+				}
+				if (!ok)
+					closeClient(fd);
+			}
+		}
+
+		// New frames go out to everyone who can take them straight away, and anyone who has made
+		// no progress for too long gets dropped.
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			Client &client = *(it++)->second;
+			bool ok = true;
+			if (wake && !client.blocked)
+				ok = sendClient(client);
+			if (ok && (!client.queue.empty() || !client.preamble.empty()) &&
+				now - client.last_progress > CLIENT_TIMEOUT)
+			{
+				LOG(1, name_ << ": client " << client.address << " stopped taking data");
+				ok = false;
+			}
+			if (!ok)
+				closeClient(client.fd);
+		}
+	}
+}
+
+void StreamServer::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t saddr_size = sizeof(saddr);
+		int fd = accept4(listen_fd_, (struct sockaddr *)&saddr, &saddr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR(name_ << ": accept failed: " << strerror(errno));
+			return;
+		}
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+		std::unique_ptr<Client> client = std::make_unique<Client>();
+		client->fd = fd;
+		client->address = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		client->ready = !request_handler_;
+		client->close = false;
+		client->blocked = false;
+		client->waiting_keyframe = true;
+		client->min_interval_us = 0;
+		client->next_timestamp_us = 0;
+		client->queued_bytes = 0;
+		client->offset = 0;
+		client->last_progress = std::chrono::steady_clock::now();
+		client->resyncs = 0;
+
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			close(fd);
+			continue;
+		}
+		LOG(1, name_ << ": client " << client->address << " connected");
+		clients_[fd] = std::move(client);
+		if (!request_handler_ && client_callback_)
+			client_callback_();
+	}
+}
+
+bool StreamServer::readClient(Client &client)
+{
+	char buf[4096];
+	ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (n == 0)
+		return false;
+	// Once we're streaming, there's nothing more a client can tell us.
+	if (client.ready || client.close)
+		return true;
+
+	client.request.append(buf, n);
+	if (client.request.size() > sizeof(buf))
+		return false;
+	Handshake handshake;
+	if (!request_handler_(client.request, handshake))
+		return true;
+
+	client.preamble = handshake.response;
+	client.close = handshake.close;
+	client.ready = !handshake.close;
+	client.min_interval_us = handshake.fps > 0 ? 1000000 / handshake.fps : 0;
+	client.last_progress = std::chrono::steady_clock::now();
+	if (client.ready && client_callback_)
+		client_callback_();
+	return sendClient(client);
+}
+
+bool StreamServer::sendClient(Client &client)
+{
+	while (true)
+	{
+		// Gather up everything we can send in one go, skipping what went last time.
+		struct iovec iov[MAX_IOV];
+		unsigned int num_iov = 0;
+		size_t skip = client.offset;
+		auto add = [&](void const *data, size_t size) {
+			if (skip >= size)
+				skip -= size;
+			else if (num_iov < MAX_IOV)
+			{
+				iov[num_iov++] = { (uint8_t *)data + skip, size - skip };
+				skip = 0;
+			}
+		};
+		if (!client.preamble.empty())
+			add(client.preamble.data(), client.preamble.size());
+		for (auto it = client.queue.begin(); it != client.queue.end() && num_iov < MAX_IOV; it++)
+		{
+			add((*it)->header.data(), (*it)->header.size());
+			add((*it)->data.data(), (*it)->data.size());
+			add((*it)->trailer.data(), (*it)->trailer.size());
+		}
+		if (!num_iov)
+			return !client.close;
+
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num_iov;
+		ssize_t n = sendmsg(client.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			setBlocked(client, true);
+			return true;
+		}
+		if (n <= 0)
+		{
+			LOG(1, name_ << ": client " << client.address << " disconnected");
+			return false;
+		}
+		client.last_progress = std::chrono::steady_clock::now();
+
+		// Work out what has now gone completely.
+		size_t sent = client.offset + n;
+		if (!client.preamble.empty())
+		{
+			if (sent < client.preamble.size())
+			{
+				client.offset = sent;
+				continue;
+			}
+			sent -= client.preamble.size();
+			client.preamble.clear();
+		}
+		while (!client.queue.empty() && sent >= client.queue.front()->Size())
+		{
+			sent -= client.queue.front()->Size();
+			client.queued_bytes -= client.queue.front()->Size();
+			client.queue.pop_front();
+		}
+		client.offset = sent;
+	}
+}
+
+void StreamServer::setBlocked(Client &client, bool blocked)
+{
+	if (client.blocked == blocked)
+		return;
+	// Only ask to hear when we can write while there's something waiting to go.
+	client.blocked = blocked;
+	epoll_event event = {};
+	event.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd = client.fd;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.fd, &event);
+}
+
+void StreamServer::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	if (it->second->resyncs)
+		LOG(1, name_ << ": client " << it->second->address << " skipped frames " << it->second->resyncs << " times");
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(it);
+}
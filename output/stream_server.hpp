@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * stream_server.hpp - serve a stream of frames to any number of network clients.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The server runs its own thread, which accepts clients and does all the (non-blocking) sending,
+// so that no client can ever hold up the encoder. Every frame is copied once, into a buffer that
+// all the clients share, and each client has a queue of the frames it still has to send. Clients
+// that fall too far behind lose what's queued and start again at the next keyframe, and clients
+// that stop taking data altogether get dropped.
+
+class StreamServer
+{
+public:
+	struct Frame
+	{
+		// The header and trailer get sent either side of the data, for protocols that need them.
+		std::string header;
+		std::vector<uint8_t> data;
+		std::string trailer;
+		bool keyframe;
+		int64_t timestamp_us;
+		size_t Size() const { return header.size() + data.size() + trailer.size(); }
+	};
+	using FramePtr = std::shared_ptr<Frame>;
+
+	// Clients may have to send a request before they get anything (as in HTTP). The handler is given
+	// everything received so far, and returns false if it needs more. When it's happy, it can give a
+	// response to send before any frames, a frame rate limit for the client, or ask for the client to
+	// be closed once the response has gone.
+	struct Handshake
+	{
+		std::string response;
+		double fps = 0;
+		bool close = false;
+	};
+	using RequestHandler = std::function<bool(std::string const &request, Handshake &handshake)>;
+	// Called when a client is ready for frames, as it will be waiting for a keyframe.
+	using ClientCallback = std::function<void()>;
+
+	StreamServer(std::string const &name, int port, size_t max_queue, RequestHandler request_handler,
+				 ClientCallback client_callback);
+	~StreamServer();
+	// Frames are recycled once no client has them queued any more.
+	FramePtr GetFrame();
+	// Queue the frame for every client that is ready for it.
+	void Send(FramePtr const &frame);
+
+private:
+	struct Client
+	{
+		int fd;
+		std::string address;
+		std::string request;
+		bool ready;
+		bool close;
+		bool blocked;
+		bool waiting_keyframe;
+		// With a frame rate limit, this is when the client's next frame is due.
+		int64_t min_interval_us;
+		int64_t next_timestamp_us;
+		// Bytes that go before any frames, and the frames still to send. Offset is how much of the
+		// first of these has gone already.
+		std::string preamble;
+		std::deque<FramePtr> queue;
+		size_t queued_bytes;
+		size_t offset;
+		std::chrono::steady_clock::time_point last_progress;
+		unsigned int resyncs;
+	};
+
+	void serverThread();
+	void queueFrame(FramePtr const &frame);
+	void acceptClients();
+	bool readClient(Client &client);
+	bool sendClient(Client &client);
+	void setBlocked(Client &client, bool blocked);
+	void closeClient(int fd);
+
+	std::string name_;
+	size_t max_queue_;
+	RequestHandler request_handler_;
+	ClientCallback client_callback_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	// Only the server thread touches the clients, so new frames wait here for it to pick them up.
+	bool abort_;
+	std::vector<FramePtr> pending_;
+	std::mutex mutex_;
+	std::map<int, std::unique_ptr<Client>> clients_;
+	std::vector<FramePtr> frame_pool_;
+	std::thread server_thread_;
+};
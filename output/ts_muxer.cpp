@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.cpp - wrap H.264 frames in an MPEG transport stream.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "ts_muxer.hpp"
+
+static constexpr uint16_t PAT_PID = 0;
+static constexpr uint16_t PMT_PID = 0x1000;
+static constexpr uint16_t VIDEO_PID = 0x100;
+static constexpr uint8_t STREAM_TYPE_H264 = 0x1b;
+// How often the PAT and PMT get repeated, even without keyframes.
+static constexpr int64_t TABLE_INTERVAL_US = 100000;
+// PTS (at 90kHz) runs this far ahead of the PCR, to give decoders some room.
+static constexpr int64_t PTS_DELAY = 90000 / 5;
+
+// The CRC that the PSI sections end with (MPEG-2, polynomial 0x04c11db7 and not reflected).
+static uint32_t crc32(uint8_t const *data, size_t size)
+{
+	static uint32_t const *table = [] {
+		static uint32_t t[256];
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t crc = i << 24;
+			for (int j = 0; j < 8; j++)
+				crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+			t[i] = crc;
+		}
+		return t;
+	}();
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < size; i++)
+		crc = (crc << 8) ^ table[(crc >> 24) ^ data[i]];
+	return crc;
+}
+
+// Fill in a packet payload from a PSI section (that has room for its CRC on the end).
+static void make_table(uint8_t *payload, uint8_t *section, size_t size)
+{
+	uint32_t crc = crc32(section, size - 4);
+	section[size - 4] = crc >> 24, section[size - 3] = crc >> 16, section[size - 2] = crc >> 8;
+	section[size - 1] = crc;
+	memset(payload, 0xff, TsMuxer::PACKET_SIZE - 4);
+	payload[0] = 0; // pointer field
+	memcpy(payload + 1, section, size);
+}
+
+static void write_timestamp(uint8_t *p, uint8_t prefix, int64_t ts)
+{
+	p[0] = prefix | ((ts >> 29) & 0x0e) | 1;
+	p[1] = ts >> 22;
+	p[2] = (ts >> 14) | 1;
+	p[3] = ts >> 7;
+	p[4] = (ts << 1) | 1;
+}
+
+TsMuxer::TsMuxer(size_t max_packets, OutputFn output)
+	: output_(output), buffer_(max_packets * PACKET_SIZE), max_packets_(max_packets), num_packets_(0),
+	  pat_continuity_(0), pmt_continuity_(0), video_continuity_(0), last_tables_us_(-1)
+{
+	// One program, whose PMT lists just the video stream, which also carries the PCR.
+	uint8_t pat[] = { 0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00, 0x00, 0x01, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff,
+					  0, 0, 0, 0 };
+	make_table(pat_, pat, sizeof(pat));
+	uint8_t pmt[] = { 0x02, 0xb0, 18, 0x00, 0x01, 0xc1, 0x00, 0x00, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff,
+					  0xf0, 0x00, STREAM_TYPE_H264, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+					  0, 0, 0, 0 };
+	make_table(pmt_, pmt, sizeof(pmt));
+}
+
+void TsMuxer::Mux(uint8_t *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	if (keyframe || last_tables_us_ < 0 || timestamp_us < last_tables_us_ ||
+		timestamp_us - last_tables_us_ >= TABLE_INTERVAL_US)
+	{
+		writePacket(PAT_PID, pat_continuity_, true, -1, false, nullptr, 0, pat_, sizeof(pat_));
+		writePacket(PMT_PID, pmt_continuity_, true, -1, false, nullptr, 0, pmt_, sizeof(pmt_));
+		last_tables_us_ = timestamp_us;
+	}
+
+	// The PES header, which has no length as it's video. H.264 in a transport stream must have
+	// access unit delimiters, so we add one if the encoder didn't.
+	int64_t pcr = timestamp_us * 27;
+	uint8_t header[20] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x84, 0x80, 0x05 };
+	write_timestamp(header + 9, 0x20, (pcr / 300 + PTS_DELAY) & 0x1ffffffffLL);
+	size_t header_size = 14;
+	uint8_t *nal = size >= 4 && mem[2] == 0 ? mem + 4 : mem + 3;
+	if (size < 4 || (*nal & 0x1f) != 9)
+	{
+		static const uint8_t aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+		memcpy(header + header_size, aud, sizeof(aud));
+		header_size += sizeof(aud);
+	}
+
+	// Only the first packet of the frame carries the PCR and PES header.
+	size_t n = writePacket(VIDEO_PID, video_continuity_, true, pcr, keyframe, header, header_size, mem, size);
+	for (mem += n, size -= n; size; mem += n, size -= n)
+		n = writePacket(VIDEO_PID, video_continuity_, false, -1, false, nullptr, 0, mem, size);
+
+	flush();
+}
+
+size_t TsMuxer::writePacket(uint16_t pid, uint8_t &continuity, bool unit_start, int64_t pcr, bool random_access,
+							uint8_t const *header, size_t header_size, uint8_t const *data, size_t size)
+{
+	if (num_packets_ == max_packets_)
+		flush();
+	uint8_t *p = buffer_.data() + num_packets_++ * PACKET_SIZE;
+
+	// Any space we can't fill gets stuffed in the adaptation field, which must then have at least
+	// its length and probably its flags.
+	size_t adaptation = pcr >= 0 ? 8 : random_access ? 2 : 0;
+	size_t n = std::min(size, PACKET_SIZE - 4 - adaptation - header_size);
+	size_t stuffing = PACKET_SIZE - 4 - adaptation - header_size - n;
+	if (stuffing && !adaptation)
+	{
+		adaptation = std::min<size_t>(stuffing, 2);
+		stuffing -= adaptation;
+	}
+
+	p[0] = 0x47;
+	p[1] = (unit_start ? 0x40 : 0) | (pid >> 8);
+	p[2] = pid;
+	p[3] = (adaptation ? 0x30 : 0x10) | continuity;
+	continuity = (continuity + 1) & 0x0f;
+	uint8_t *q = p + 4;
+	if (adaptation)
+	{
+		*q++ = adaptation - 1 + stuffing;
+		if (adaptation >= 2)
+			*q++ = (random_access ? 0x40 : 0) | (pcr >= 0 ? 0x10 : 0);
+		if (pcr >= 0)
+		{
+			int64_t base = (pcr / 300) & 0x1ffffffffLL, extension = pcr % 300;
+			q[0] = base >> 25, q[1] = base >> 17, q[2] = base >> 9, q[3] = base >> 1;
+			q[4] = ((base & 1) << 7) | 0x7e | (extension >> 8), q[5] = extension;
+			q += 6;
+		}
+		memset(q, 0xff, stuffing);
+		q += stuffing;
+	}
+	if (header_size)
+		memcpy(q, header, header_size);
+	memcpy(q + header_size, data, n);
+	return n;
+}
+
+void TsMuxer::flush()
+{
+	if (num_packets_)
+		output_(buffer_.data(), num_packets_ * PACKET_SIZE);
+	num_packets_ = 0;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.hpp - wrap H.264 frames in an MPEG transport stream.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Each frame becomes one PES packet, split across as many 188 byte TS packets as it needs. The
+// PAT and PMT go out before every keyframe, and at least every 100ms anyway, so that receivers
+// can join at any time. The packets are built in a buffer that we allocate once, and handed over
+// max_packets at a time (and at the end of every frame).
+
+class TsMuxer
+{
+public:
+	static constexpr size_t PACKET_SIZE = 188;
+	typedef std::function<void(uint8_t *data, size_t size)> OutputFn;
+
+	TsMuxer(size_t max_packets, OutputFn output);
+	void Mux(uint8_t *mem, size_t size, int64_t timestamp_us, bool keyframe);
+
+private:
+	size_t writePacket(uint16_t pid, uint8_t &continuity, bool unit_start, int64_t pcr, bool random_access,
+					   uint8_t const *header, size_t header_size, uint8_t const *data, size_t size);
+	void flush();
+
+	OutputFn output_;
+	std::vector<uint8_t> buffer_;
+	size_t max_packets_;
+	size_t num_packets_;
+	// The PAT and PMT never change, so we make their payloads just once.
+	uint8_t pat_[PACKET_SIZE - 4];
+	uint8_t pmt_[PACKET_SIZE - 4];
+	uint8_t pat_continuity_;
+	uint8_t pmt_continuity_;
+	uint8_t video_continuity_;
+	int64_t last_tables_us_;
+};
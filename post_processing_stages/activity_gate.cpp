@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * activity_gate.cpp - let expensive stages run only when a cheap one reports activity
+ */
+
+#include <algorithm>
+
+#include "activity_gate.hpp"
+
+static libcamera::Rectangle rectangle_union(libcamera::Rectangle const &a, libcamera::Rectangle const &b)
+{
+	int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+	int x1 = std::max<int>(a.x + a.width, b.x + b.width), y1 = std::max<int>(a.y + a.height, b.y + b.height);
+	return libcamera::Rectangle(x0, y0, x1 - x0, y1 - y0);
+}
+
+ActivityGate::ActivityGate()
+	: hold_(0), use_region_(false), margin_(0), active_seen_(false), last_active_(0), have_region_(false),
+	  have_results_(false), results_sequence_(0)
+{
+}
+
+void ActivityGate::Read(boost::property_tree::ptree const &params)
+{
+	stage_ = params.get<std::string>("gate_stage", "");
+	hold_ = params.get<unsigned int>("gate_hold", 10);
+	use_region_ = params.get<int>("gate_region", 0);
+	margin_ = params.get<float>("gate_margin", 0.25);
+
+	result_tag_ = stage_ + ".result";
+	region_tag_ = stage_ + ".region";
+}
+
+bool ActivityGate::Update(CompletedRequest &completed_request)
+{
+	if (!Enabled())
+		return true;
+
+	bool active = false;
+	completed_request.post_process_metadata.Get(result_tag_, active);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Requests are processed in parallel so may arrive slightly out of order; an older
+	// request counts as being inside the hold period.
+	int since_active = completed_request.sequence - last_active_;
+
+	if (active)
+	{
+		active_seen_ = true;
+		last_active_ = std::max(last_active_, completed_request.sequence);
+		since_active = 0;
+		libcamera::Rectangle region;
+		if (completed_request.post_process_metadata.Get(region_tag_, region) == 0)
+		{
+			// Keep growing the region while activity continues in the same burst, so that
+			// something moving steadily stays inside it.
+			region_ = have_region_ ? rectangle_union(region_, region) : region;
+			have_region_ = true;
+		}
+	}
+	else if (since_active > static_cast<int>(hold_))
+		have_region_ = false;
+
+	return active_seen_ && since_active <= static_cast<int>(hold_);
+}
+
+libcamera::Rectangle ActivityGate::Region(unsigned int width, unsigned int height) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!have_region_)
+		return libcamera::Rectangle(0, 0, width, height);
+
+	int pad_x = region_.width * margin_, pad_y = region_.height * margin_;
+	int x0 = std::clamp<int>(region_.x - pad_x, 0, width);
+	int y0 = std::clamp<int>(region_.y - pad_y, 0, height);
+	int x1 = std::clamp<int>(region_.x + region_.width + pad_x, x0, width);
+	int y1 = std::clamp<int>(region_.y + region_.height + pad_y, y0, height);
+
+	return libcamera::Rectangle(x0, y0, x1 - x0, y1 - y0);
+}
+
+void ActivityGate::ResultsFrom(unsigned int sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	have_results_ = true;
+	results_sequence_ = sequence;
+}
+
+int ActivityGate::Age(unsigned int sequence) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return have_results_ ? sequence - results_sequence_ : -1;
+}
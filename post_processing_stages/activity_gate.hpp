@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * activity_gate.hpp - let expensive stages run only when a cheap one reports activity
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <libcamera/geometry.h>
+
+#include "core/completed_request.hpp"
+
+// An ActivityGate lets an expensive stage (a neural network, a cascade classifier...)
+// skip its work while a cheap stage earlier in the pipeline, typically "motion_detect",
+// reports that nothing is happening. The gating stage is expected to write
+// "<gate_stage>.result" (a bool) into the post-processing metadata and may also write
+// "<gate_stage>.region" (a libcamera::Rectangle in low resolution image pixels) to say
+// where the activity was.
+//
+// The following parameters are read from the expensive stage's own json:
+//
+// "gate_stage" - name of the gating stage, leave empty (the default) for no gating
+// "gate_hold" - number of frames to carry on running after the last reported activity
+// "gate_region" - set to 1 to restrict the expensive stage to the active region
+// "gate_margin" - fraction of the active region's size to add all round it
+//
+// The gate also counts the "age" of a stage's results, that is, how many frames ago
+// the image that produced them was captured, so that stale results can be recognised.
+
+class ActivityGate
+{
+public:
+	ActivityGate();
+
+	void Read(boost::property_tree::ptree const &params);
+
+	bool Enabled() const { return !stage_.empty(); }
+
+	bool UseRegion() const { return Enabled() && use_region_; }
+
+	// Look for activity reported in this request. Returns true if the expensive stage
+	// should run on it. Call this on every request, not just the ones the stage might
+	// run on, so that no activity gets missed.
+	bool Update(CompletedRequest &completed_request);
+
+	// Return the most recent active region, padded by the margin and clipped to the given
+	// image size. If there is no region, the whole image is returned.
+	libcamera::Rectangle Region(unsigned int width, unsigned int height) const;
+
+	// Record that results were produced from the image with this sequence number.
+	void ResultsFrom(unsigned int sequence);
+
+	// Number of frames since the image behind the current results was captured, or -1 if
+	// there are no results yet.
+	int Age(unsigned int sequence) const;
+
+private:
+	std::string stage_;
+	std::string result_tag_;
+	std::string region_tag_;
+	unsigned int hold_;
+	bool use_region_;
+	float margin_;
+
+	mutable std::mutex mutex_;
+	bool active_seen_;
+	unsigned int last_active_;
+	bool have_region_;
+	libcamera::Rectangle region_;
+	bool have_results_;
+	unsigned int results_sequence_;
+};
@@ -7,8 +7,17 @@
 
 // The text string can include the % directives supported by FrameInfo.
 
+// Rendering text with OpenCV every frame is surprisingly expensive for large images,
+// so we rasterise each character once into a glyph cache, and keep a bitmap of the
+// whole string we drew last time. When the text changes (typically just the frame
+// counter or the time) only the characters that actually changed get redrawn into it.
+// The text itself is compiled once by InfoText rather than being searched every frame.
+
 #include <time.h>
 
+#include <algorithm>
+#include <unordered_map>
+
 #include <libcamera/stream.h>
 
 #include "core/frame_info.hpp"
@@ -19,6 +28,10 @@
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 using namespace cv;
 
 using Stream = libcamera::Stream;
@@ -37,6 +50,14 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	struct Glyph
+	{
+		Mat mask;
+		double advance;
+	};
+	Glyph const &getGlyph(char c);
+	void renderLine(std::string_view text);
+
 	Stream *stream_;
 	StreamInfo info_;
 	std::string text_;
@@ -47,6 +68,21 @@ private:
 	double alpha_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+
+	// Everything below is protected by the mutex as requests get processed in parallel.
+	std::mutex mutex_;
+	int font_;
+	int ascent_;
+	int box_height_;
+	int pad_; // glyphs can spill this far outside their own cell
+	std::unordered_map<char, Glyph> glyphs_;
+	// The bitmap of the most recent string, and where each character starts in it.
+	std::string line_text_;
+	std::vector<int> line_x_;
+	std::vector<int> new_x_;
+	std::vector<std::pair<int, int>> dirty_;
+	Mat line_mask_;
+	InfoText info_text_;
 };
 
 #define NAME "annotate_cv"
@@ -78,6 +114,122 @@ void AnnotateCvStage::Configure()
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * info_.width / 1200;
 	adjusted_thickness_ = std::max(thickness_ * info_.width / 700, 1u);
+
+	// The height of a line of text doesn't depend on what's in it.
+	font_ = FONT_HERSHEY_SIMPLEX;
+	int baseline = 0;
+	ascent_ = getTextSize("", font_, adjusted_scale_, adjusted_thickness_, &baseline).height;
+	box_height_ = std::min<int>(ascent_ + baseline, info_.height);
+	pad_ = adjusted_thickness_ + 1;
+
+	glyphs_.clear();
+	line_text_.clear();
+	line_x_.assign(1, 0);
+	line_mask_ = Mat::zeros(box_height_, info_.width, CV_8U);
+}
+
+AnnotateCvStage::Glyph const &AnnotateCvStage::getGlyph(char c)
+{
+	auto it = glyphs_.find(c);
+	if (it != glyphs_.end())
+		return it->second;
+
+	// Hershey font advances scale linearly, so measure at a large scale to avoid rounding.
+	std::string s(1, c);
+	constexpr double measure_scale = 1000.0;
+	Glyph glyph;
+	glyph.advance = getTextSize(s, font_, measure_scale, 0, nullptr).width * adjusted_scale_ / measure_scale;
+	glyph.mask = Mat::zeros(box_height_, cvCeil(glyph.advance) + 2 * pad_, CV_8U);
+	putText(glyph.mask, s, Point(pad_, ascent_), font_, adjusted_scale_, 255, adjusted_thickness_, 0);
+
+	return glyphs_.emplace(c, std::move(glyph)).first->second;
+}
+
+void AnnotateCvStage::renderLine(std::string_view text)
+{
+	if (text == line_text_)
+		return;
+
+	// Work out where every character goes in the new string.
+	new_x_.resize(text.size() + 1);
+	double x = 0;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		new_x_[i] = cvRound(x);
+		x += getGlyph(text[i]).advance;
+	}
+	new_x_[text.size()] = cvRound(x);
+
+	// Any character that differs from last time, or has moved, makes its cell (plus the
+	// bits that could have spilled into its neighbours) dirty, both where it used to be
+	// and where it is now.
+	dirty_.clear();
+	size_t n = std::max(text.size(), line_text_.size());
+	for (size_t i = 0; i < n; i++)
+	{
+		bool in_old = i < line_text_.size(), in_new = i < text.size();
+		if (in_old && in_new && text[i] == line_text_[i] && new_x_[i] == line_x_[i] &&
+			new_x_[i + 1] == line_x_[i + 1])
+			continue;
+		if (in_old)
+			dirty_.emplace_back(line_x_[i] - pad_, line_x_[i + 1] + pad_);
+		if (in_new)
+			dirty_.emplace_back(new_x_[i] - pad_, new_x_[i + 1] + pad_);
+	}
+
+	for (auto &span : dirty_)
+	{
+		int x0 = std::clamp(span.first, 0, line_mask_.cols), x1 = std::clamp(span.second, 0, line_mask_.cols);
+		if (x1 > x0)
+			line_mask_.colRange(x0, x1).setTo(0);
+	}
+
+	// Now redraw every character that touches a cleared area.
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		Glyph const &glyph = getGlyph(text[i]);
+		int g0 = new_x_[i] - pad_, g1 = g0 + glyph.mask.cols;
+		if (std::none_of(dirty_.begin(), dirty_.end(),
+						 [g0, g1](auto const &span) { return g0 < span.second && span.first < g1; }))
+			continue;
+
+		int x0 = std::max(g0, 0), x1 = std::min(g1, line_mask_.cols);
+		if (x1 <= x0)
+			continue;
+		Mat dst = line_mask_.colRange(x0, x1);
+		cv::max(dst, glyph.mask.colRange(x0 - g0, x1 - g0), dst);
+	}
+
+	line_text_ = text;
+	std::swap(line_x_, new_x_);
+}
+
+// Blend a row of the background box, replacing the pixels that are set in the text mask
+// with the foreground colour. Weights are in 1/128ths so that everything fits in 16 bits.
+
+static void blend_row(uint8_t *ptr, uint8_t const *mask, int width, uint16_t bias, uint8_t weight, uint8_t fg)
+{
+	int x = 0;
+#if defined(__ARM_NEON)
+	uint16x8_t bias_v = vdupq_n_u16(bias);
+	uint8x8_t weight_v = vdup_n_u8(weight);
+	uint8x16_t fg_v = vdupq_n_u8(fg);
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t p = vld1q_u8(ptr + x);
+		uint8x16_t m = vld1q_u8(mask + x);
+		uint16x8_t lo = vmlal_u8(bias_v, vget_low_u8(p), weight_v);
+		uint16x8_t hi = vmlal_u8(bias_v, vget_high_u8(p), weight_v);
+		uint8x16_t out = vcombine_u8(vshrn_n_u16(lo, 7), vshrn_n_u16(hi, 7));
+		vst1q_u8(ptr + x, vbslq_u8(vtstq_u8(m, m), fg_v, out));
+	}
+#endif
+	// Written so that the compiler can vectorise it on other platforms.
+	for (; x < width; x++)
+	{
+		uint8_t blended = (bias + weight * ptr[x]) >> 7;
+		ptr[x] = mask[x] ? fg : blended;
+	}
 }
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
@@ -86,29 +238,22 @@ bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 	FrameInfo info(completed_request->metadata);
 	info.sequence = completed_request->sequence;
 
-	// Other post-processing stages can supply metadata to update the text.
-	completed_request->post_process_metadata.Get("annotate.text", text_);
-	std::string text = info.ToString(text_);
-	char text_with_date[256];
-	time_t t = time(NULL);
-	tm *tm_ptr = localtime(&t);
-	if (strftime(text_with_date, sizeof(text_with_date), text.c_str(), tm_ptr) != 0)
-		text = std::string(text_with_date);
+	std::lock_guard<std::mutex> lock(mutex_);
 
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(info_.height, info_.width, CV_8U, ptr, info_.stride);
-	int font = FONT_HERSHEY_SIMPLEX;
+	// Other post-processing stages can supply metadata to update the text. The template
+	// only gets recompiled if the text actually changes.
+	completed_request->post_process_metadata.Get("annotate.text", text_);
+	info_text_.Compile(text_);
 
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+	renderLine(info_text_.Format(info, time(NULL)));
 
 	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += info_.stride)
-	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
-	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
+	int width = std::min(line_x_.back() + adjusted_thickness_, line_mask_.cols);
+	int alpha = std::clamp<int>(alpha_ * 128 + 0.5, 0, 128);
+	uint16_t bias = bg_ * alpha + 64;
+	uint8_t *ptr = (uint8_t *)buffer.data();
+	for (int y = 0; y < box_height_; y++, ptr += info_.stride)
+		blend_row(ptr, line_mask_.ptr<uint8_t>(y), width, bias, 128 - alpha, fg_);
 
 	return false;
 }
@@ -5,6 +5,11 @@
  * face_detect_cv_stage.cpp - Face Detector implementation, using OpenCV
  */
 
+// When "track" is set, most refreshes only search (padded) regions around the faces
+// found last time, which is far cheaper than searching the whole image. Every
+// "full_scan_period" refreshes, or whenever we have no faces to track, the whole
+// image is searched again so that new faces get picked up.
+
 #include <algorithm>
 #include <chrono>
 #include <iostream>
@@ -17,6 +22,7 @@
 
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/activity_gate.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "opencv2/imgproc.hpp"
@@ -44,6 +50,7 @@ public:
 private:
 	void detectFeatures(cv::CascadeClassifier &cascade);
 	void drawFeatures(cv::Mat &img);
+	void chooseSearchRegions(cv::Rect const &search);
 
 	Stream *stream_;
 	StreamInfo low_res_info_;
@@ -53,7 +60,15 @@ private:
 	std::mutex face_mutex_;
 	std::mutex future_ptr_mutex_;
 	Mat image_;
+	// Position of image_ within the low res image, and the frame it came from.
+	cv::Point image_offset_;
+	unsigned int image_sequence_;
+	// Regions of image_ to search, and whether that counts as a full scan.
+	std::vector<cv::Rect> regions_;
+	bool full_scan_;
 	std::vector<cv::Rect> faces_;
+	// The faces again, but in low res image coordinates.
+	std::vector<cv::Rect> lores_faces_;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
 	double scaling_factor_;
@@ -62,6 +77,19 @@ private:
 	int max_size_;
 	int refresh_rate_;
 	int draw_features_;
+	int track_;
+	int full_scan_period_;
+	double track_padding_;
+	int verbose_;
+	ActivityGate gate_;
+	unsigned int refresh_count_;
+	// Scan statistics. These are only updated by the detection thread.
+	struct ScanStats
+	{
+		unsigned int count = 0;
+		double total_time = 0; // in microseconds
+		unsigned int faces = 0;
+	} full_stats_, tracked_stats_;
 };
 
 #define NAME "face_detect_cv"
@@ -83,6 +111,11 @@ void FaceDetectCvStage::Read(boost::property_tree::ptree const &params)
 	max_size_ = params.get<int>("max_size", 256);
 	refresh_rate_ = params.get<int>("refresh_rate", 5);
 	draw_features_ = params.get<int>("draw_features", 1);
+	track_ = params.get<int>("track", 0);
+	full_scan_period_ = std::max(params.get<int>("full_scan_period", 10), 1);
+	track_padding_ = params.get<double>("track_padding", 0.5);
+	verbose_ = params.get<int>("verbose", 0);
+	gate_.Read(params);
 }
 
 void FaceDetectCvStage::Configure()
@@ -108,6 +141,9 @@ void FaceDetectCvStage::Configure()
 	full_stream_info_ = app_->GetStreamInfo(full_stream_);
 	if (draw_features_ && full_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("FaceDetectCvStage: drawing only supported for YUV420 images");
+
+	refresh_count_ = 0;
+	full_stats_ = tracked_stats_ = {};
 }
 
 bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
@@ -115,15 +151,27 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
+	// Always let the gate see the request, even if we aren't going to run now.
+	bool active = gate_.Update(*completed_request);
+
 	{
 		std::unique_lock<std::mutex> lck(future_ptr_mutex_);
-		if (completed_request->sequence % refresh_rate_ == 0 &&
+		if (active && completed_request->sequence % refresh_rate_ == 0 &&
 			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
 			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 			uint8_t *ptr = (uint8_t *)buffer.data();
 			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
+			Rect search(0, 0, low_res_info_.width, low_res_info_.height);
+			if (gate_.UseRegion())
+			{
+				libcamera::Rectangle r = gate_.Region(low_res_info_.width, low_res_info_.height);
+				search = Rect(r.x, r.y, r.width, r.height);
+			}
+			image_ = image(search).clone();
+			image_offset_ = search.tl();
+			image_sequence_ = completed_request->sequence;
+			chooseSearchRegions(search);
 
 			future_ptr_ = std::make_unique<std::future<void>>();
 			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
@@ -136,6 +184,8 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	std::transform(faces_.begin(), faces_.end(), std::back_inserter(temprect),
 				   [](Rect &r) { return libcamera::Rectangle(r.x, r.y, r.width, r.height); });
 	completed_request->post_process_metadata.Set("detected_faces", temprect);
+	if (gate_.Enabled())
+		completed_request->post_process_metadata.Set(NAME ".age", gate_.Age(completed_request->sequence));
 
 	if (draw_features_)
 	{
@@ -148,13 +198,77 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
+void FaceDetectCvStage::chooseSearchRegions(Rect const &search)
 {
-	equalizeHist(image_, image_);
+	// Called with future_ptr_mutex_ held and no detection running.
+	Rect bounds(0, 0, image_.cols, image_.rows);
+	bool full_scan = !track_ || refresh_count_++ % full_scan_period_ == 0;
+
+	regions_.clear();
+	if (!full_scan)
+	{
+		std::unique_lock<std::mutex> lock(face_mutex_);
+		for (auto const &face : lores_faces_)
+		{
+			int pad_x = face.width * track_padding_, pad_y = face.height * track_padding_;
+			Rect region(face.x - pad_x - search.x, face.y - pad_y - search.y, face.width + 2 * pad_x,
+						face.height + 2 * pad_y);
+			region &= bounds;
+			if (region.area() == 0)
+				continue;
+
+			// Merge overlapping regions, or faces in the overlap would be found twice. A merged region
+			// is bigger, so it may now overlap regions we already passed, and we have to start again.
+			for (auto it = regions_.begin(); it != regions_.end();)
+			{
+				if ((region & *it).area())
+				{
+					region |= *it;
+					regions_.erase(it);
+					it = regions_.begin();
+				}
+				else
+					it++;
+			}
+			regions_.push_back(region);
+		}
+	}
+
+	// With nothing to track we have to look everywhere.
+	full_scan_ = regions_.empty();
+	if (full_scan_)
+		regions_.push_back(bounds);
+}
 
+void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
+{
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
-							 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	auto time_taken = ExecutionTime<std::micro>([&] {
+		// Only equalise the parts of the image we're going to search.
+		for (auto const &region : regions_)
+		{
+			if (region.empty())
+				continue;
+			Mat roi = image_(region);
+			equalizeHist(roi, roi);
+			std::vector<Rect> found;
+			cascade.detectMultiScale(roi, found, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+									 Size(min_size_, min_size_), Size(max_size_, max_size_));
+			for (auto const &face : found)
+				temp_faces.push_back(face + region.tl() + image_offset_);
+		}
+	}).count();
+
+	ScanStats &stats = full_scan_ ? full_stats_ : tracked_stats_;
+	stats.count++;
+	stats.total_time += time_taken;
+	stats.faces += temp_faces.size();
+	if (verbose_ > 1)
+		LOG(1, "FaceDetectCvStage: " << (full_scan_ ? "full" : "tracked") << " scan of " << regions_.size()
+									 << " region(s) found " << temp_faces.size() << " face(s) in " << time_taken
+									 << " us");
+
+	std::vector<Rect> lores_faces = temp_faces;
 
 	// Scale faces back to the size and location in the full res image.
 	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
@@ -168,6 +282,8 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	}
 	std::unique_lock<std::mutex> lock(face_mutex_);
 	faces_ = std::move(temp_faces);
+	lores_faces_ = std::move(lores_faces);
+	gate_.ResultsFrom(image_sequence_);
 }
 
 void FaceDetectCvStage::drawFeatures(Mat &img)
@@ -202,6 +318,18 @@ void FaceDetectCvStage::Stop()
 {
 	if (future_ptr_)
 		future_ptr_->wait();
+
+	auto report = [](char const *name, ScanStats const &stats) {
+		if (stats.count)
+			LOG(1, "FaceDetectCvStage: " << stats.count << " " << name << " scans, average time "
+										 << stats.total_time / stats.count << " us, average faces "
+										 << (double)stats.faces / stats.count);
+	};
+	if (verbose_)
+	{
+		report("full", full_stats_);
+		report("tracked", tracked_stats_);
+	}
 }
 
 static PostProcessingStage *Create(LibcameraApp *app)
@@ -20,6 +20,11 @@
 // the application can take that as true immediately. To be sure there's no motion,
 // an application should probably wait for "a few frames" of "no motion".
 
+// When motion is detected, "motion_detect.region" is also added, giving the bounding
+// rectangle of all the changed pixels in the coordinates of the (full) lores image.
+// Other stages can use this to restrict where they look (see activity_gate.hpp).
+
+#include <libcamera/geometry.h>
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
@@ -157,6 +162,7 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 
 	bool motion_detected = false;
 	unsigned int regions = 0;
+	unsigned int x_min = roi_width_, x_max = 0, y_min = roi_height_, y_max = 0;
 
 	// Count the lores pixels where the difference between the new and previous values
 	// exceeds the threshold. At the same time, update the previous image buffer.
@@ -169,10 +175,15 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 			int new_value = *new_value_ptr;
 			int old_value = *old_value_ptr;
 			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			if (std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c)
+			{
+				regions++;
+				x_min = std::min(x_min, x), x_max = std::max(x_max, x);
+				y_min = std::min(y_min, y), y_max = std::max(y_max, y);
+			}
 		}
 	}
+	motion_detected = regions >= region_threshold_;
 
 	if (config_.verbose && motion_detected != motion_detected_)
 		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped"));
@@ -180,6 +191,13 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	motion_detected_ = motion_detected;
 	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
 
+	if (motion_detected && regions)
+	{
+		libcamera::Rectangle region((roi_x_ + x_min) * config_.hskip, (roi_y_ + y_min) * config_.vskip,
+									(x_max - x_min + 1) * config_.hskip, (y_max - y_min + 1) * config_.vskip);
+		completed_request->post_process_metadata.Set("motion_detect.region", region);
+	}
+
 	return false;
 }
 
@@ -126,8 +126,8 @@ void ObjectDetectTfStage::interpretOutputs()
 		int w = std::clamp<int>(WIDTH * boxes[i * 4 + 3] - x, 0, WIDTH);
 		// The network is fed a crop from the lores (if that was too large), so the coords
 		// in the full lores image are:
-		y += (lores_info_.height - HEIGHT) / 2;
-		x += (lores_info_.width - WIDTH) / 2;
+		y += crop_y_;
+		x += crop_x_;
 		// The lores is a pure scaling of the main image (squishing if the aspect ratios
 		// don't match), so:
 		y = y * main_stream_info_.height / lores_info_.height;
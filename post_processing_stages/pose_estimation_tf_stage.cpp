@@ -96,8 +96,12 @@ void PoseEstimationTfStage::interpretOutputs()
 		libcamera::Point location_coord;
 		int x = heats_[i].x, y = heats_[i].y, j = (FEATURE_SIZE * 2) * (HEATMAP_DIMS * y + x) + i;
 
-		location_coord.y = (y * main_stream_info_.height) / (HEATMAP_DIMS - 1) + offsets[j];
-		location_coord.x = (x * main_stream_info_.width) / (HEATMAP_DIMS - 1) + offsets[j + FEATURE_SIZE];
+		// The heatmap and offsets are in the tf_w_ x tf_h_ image that the network was fed, which
+		// is a crop from the lores, which in turn is a pure scaling of the main image.
+		float lores_y = (y * tf_h_) / (float)(HEATMAP_DIMS - 1) + offsets[j] + crop_y_;
+		float lores_x = (x * tf_w_) / (float)(HEATMAP_DIMS - 1) + offsets[j + FEATURE_SIZE] + crop_x_;
+		location_coord.y = lores_y * main_stream_info_.height / lores_info_.height;
+		location_coord.x = lores_x * main_stream_info_.width / lores_info_.width;
 
 		locations_.push_back(location_coord);
 	}
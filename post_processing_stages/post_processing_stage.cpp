@@ -42,11 +42,20 @@ void PostProcessingStage::Teardown()
 }
 
 std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
+{
+	assert(src_info.width >= dst_info.width && src_info.height >= dst_info.height);
+	unsigned int off_x = ((src_info.width - dst_info.width) / 2) & ~1;
+	unsigned int off_y = ((src_info.height - dst_info.height) / 2) & ~1;
+	return Yuv420ToRgb(src, src_info, dst_info, off_x, off_y);
+}
+
+std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+													  unsigned int off_x, unsigned int off_y)
 {
 	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
 
-	assert(src_info.width >= dst_info.width && src_info.height >= dst_info.height);
-	int off_x = ((src_info.width - dst_info.width) / 2) & ~1, off_y = ((src_info.height - dst_info.height) / 2) & ~1;
+	assert(off_x + dst_info.width <= src_info.width && off_y + dst_info.height <= src_info.height);
+	off_x &= ~1, off_y &= ~1;
 	int src_Y_size = src_info.height * src_info.stride, src_U_size = (src_info.height / 2) * (src_info.stride / 2);
 
 	// We're going to process 4x2 pixel blocks, as far as alignment allows.
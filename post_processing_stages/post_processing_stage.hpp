@@ -57,6 +57,10 @@ public:
 	// image is larger than the destination.
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 
+	// As above, but crop from the given (even) offset in the source image instead.
+	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+											unsigned int off_x, unsigned int off_y);
+
 protected:
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
 	// For functions returning a value, the simplest thing would be to wrap the call in a lambda and capture
@@ -12,12 +12,15 @@
 
 struct Segmentation
 {
-	Segmentation(int w, int h, std::vector<std::string> l, const std::vector<uint8_t> &s)
-		: width(w), height(h), labels(l), segmentation(s)
+	Segmentation(int w, int h, std::vector<std::string> l, const std::vector<uint8_t> &s, int x = 0, int y = 0)
+		: width(w), height(h), labels(l), segmentation(s), crop_x(x), crop_y(y)
 	{
 	}
 	int width;
 	int height;
 	std::vector<std::string> labels;
 	std::vector<uint8_t> segmentation;
+	// Where the segmented image was cropped from in the low resolution image.
+	int crop_x;
+	int crop_y;
 };
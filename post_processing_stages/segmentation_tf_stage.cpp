@@ -84,16 +84,22 @@ void SegmentationTfStage::checkConfiguration()
 void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
 	// Store the segmentation in image metadata.
-	completed_request->post_process_metadata.Set("segmentation.result",
-												Segmentation(WIDTH, HEIGHT, labels_, segmentation_));
+	completed_request->post_process_metadata.Set(
+		"segmentation.result", Segmentation(WIDTH, HEIGHT, labels_, segmentation_, crop_x_, crop_y_));
 
-	// Optionally, draw the segmentation in the bottom right corner of the main image.
+	// Optionally, draw the segmentation in the bottom right corner of the main image, or over
+	// where it came from when the crop follows the activity.
 	if (!config()->draw)
 		return;
 
 	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[main_stream_])[0];
 	int y_offset = main_stream_info_.height - HEIGHT;
 	int x_offset = main_stream_info_.width - WIDTH;
+	if (cropFollowsActivity())
+	{
+		y_offset = std::min<int>(crop_y_ * main_stream_info_.height / lores_info_.height, y_offset) & ~1;
+		x_offset = std::min<int>(crop_x_ * main_stream_info_.width / lores_info_.width, x_offset) & ~1;
+	}
 	int scale = 255 / labels_.size();
 
 	for (int y = 0; y < HEIGHT; y++)
@@ -5,6 +5,17 @@
  * sobel_cv_stage.cpp - Sobel filter implementation, using OpenCV
  */
 
+// For the usual 3x3 kernel we don't call OpenCV at all, but run a fused blur, Sobel and
+// magnitude calculation that makes a single pass over the image, working in place with
+// a few rows of buffering. The image is split into horizontal bands which are processed
+// in parallel by a set of worker threads that persist for as long as the camera runs.
+// Other kernel sizes still go through OpenCV.
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
@@ -29,11 +40,49 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Stop() override;
+
 private:
+	// Everything a band needs, allocated up front in Configure.
+	struct Band
+	{
+		unsigned int y_start, y_end;
+		// Copies of the source rows just outside the band (two above, two below) which
+		// neighbouring bands will overwrite.
+		int halo_row[4];
+		std::vector<uint8_t> halo;
+		// Three rows of the blurred image, each with a column of padding either side.
+		std::vector<uint8_t> blurred;
+		std::vector<uint16_t> vsum;
+	};
+
+	void processGeneric(uint8_t *ptr);
+	void processBand(unsigned int index);
+	uint8_t const *sourceRow(Band const &band, int y) const;
+	void blurRow(Band &band, int y, uint8_t *dst);
+	void workerThread(unsigned int index);
+
 	Stream *stream_;
+	StreamInfo info_;
 	int ksize_ = 3;
+	unsigned int num_threads_;
+
+	std::vector<Band> bands_;
+	uint8_t *image_;
+
+	// Only one frame is processed at a time, but all the bands of it in parallel.
+	std::mutex frame_mutex_;
+	std::mutex mutex_;
+	std::condition_variable work_cond_;
+	std::condition_variable done_cond_;
+	unsigned int generation_;
+	unsigned int pending_;
+	bool abort_;
+	std::vector<std::thread> workers_;
 };
 
 #define NAME "sobel_cv"
@@ -46,6 +95,9 @@ char const *SobelCvStage::Name() const
 void SobelCvStage::Read(boost::property_tree::ptree const &params)
 {
 	ksize_ = params.get<int16_t>("ksize", 3);
+	num_threads_ = params.get<unsigned int>("threads", 0);
+	if (num_threads_ == 0)
+		num_threads_ = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
 }
 
 void SobelCvStage::Configure()
@@ -53,24 +105,221 @@ void SobelCvStage::Configure()
 	stream_ = app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("SobelCvStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+
+	// Don't let the bands get silly small.
+	unsigned int num_bands = std::clamp(info_.height / 16, 1u, num_threads_);
+	bands_.resize(num_bands);
+	for (unsigned int i = 0; i < num_bands; i++)
+	{
+		Band &band = bands_[i];
+		band.y_start = info_.height * i / num_bands;
+		band.y_end = info_.height * (i + 1) / num_bands;
+		band.halo_row[0] = band.y_start - 2, band.halo_row[1] = band.y_start - 1;
+		band.halo_row[2] = band.y_end, band.halo_row[3] = band.y_end + 1;
+		band.halo.resize(4 * info_.width);
+		band.blurred.resize(3 * (info_.width + 2));
+		band.vsum.resize(info_.width);
+	}
+}
+
+void SobelCvStage::Start()
+{
+	abort_ = false;
+	generation_ = 0;
+	pending_ = 0;
+	if (ksize_ == 3)
+	{
+		for (unsigned int i = 1; i < bands_.size(); i++)
+			workers_.emplace_back(&SobelCvStage::workerThread, this, i);
+	}
+}
+
+void SobelCvStage::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	work_cond_.notify_all();
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
+}
+
+void SobelCvStage::workerThread(unsigned int index)
+{
+	unsigned int generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cond_.wait(lock, [&] { return abort_ || generation_ != generation; });
+			if (abort_)
+				return;
+			generation = generation_;
+		}
+
+		processBand(index);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--pending_ == 0)
+			done_cond_.notify_one();
+	}
 }
 
 bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 {
-	StreamInfo info = app_->GetStreamInfo(stream_);
 	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 	uint8_t *ptr = (uint8_t *)buffer.data();
 
+	if (ksize_ != 3)
+	{
+		processGeneric(ptr);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> frame_lock(frame_mutex_);
+	image_ = ptr;
+
+	// Save the rows around each band before anyone starts overwriting them.
+	for (auto &band : bands_)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			if (band.halo_row[i] >= 0 && band.halo_row[i] < static_cast<int>(info_.height))
+				memcpy(&band.halo[i * info_.width], image_ + band.halo_row[i] * info_.stride, info_.width);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_ = bands_.size() - 1;
+		generation_++;
+	}
+	work_cond_.notify_all();
+
+	// The first band we can do ourselves.
+	processBand(0);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_cond_.wait(lock, [this] { return pending_ == 0; });
+
+	return false;
+}
+
+// Return a source row, reflecting at the image edges (as BORDER_DEFAULT does). Rows
+// outside the band come from the saved copies because their owners may already have
+// replaced them with output.
+
+uint8_t const *SobelCvStage::sourceRow(Band const &band, int y) const
+{
+	int height = info_.height;
+	if (y < 0)
+		y = std::min(-y, height - 1);
+	else if (y >= height)
+		y = std::max(2 * height - 2 - y, 0);
+
+	if (y >= static_cast<int>(band.y_start) && y < static_cast<int>(band.y_end))
+		return image_ + y * info_.stride;
+	for (int i = 0; i < 4; i++)
+	{
+		if (band.halo_row[i] == y)
+			return &band.halo[i * info_.width];
+	}
+	// Can't happen, the band only ever looks two rows beyond its edges.
+	throw std::runtime_error("SobelCvStage: row outside band");
+}
+
+// The 3x3 Gaussian is [1 2 1] in each direction, normalised by 16 with rounding. The
+// output row gets a reflected column of padding at either end for the Sobel.
+
+void SobelCvStage::blurRow(Band &band, int y, uint8_t *dst)
+{
+	uint8_t const *above = sourceRow(band, y - 1);
+	uint8_t const *row = sourceRow(band, y);
+	uint8_t const *below = sourceRow(band, y + 1);
+	uint16_t *vsum = band.vsum.data();
+	int width = info_.width;
+
+	for (int x = 0; x < width; x++)
+		vsum[x] = above[x] + 2 * row[x] + below[x];
+
+	uint8_t *out = dst + 1;
+	if (width == 1)
+	{
+		out[0] = (4 * vsum[0] + 8) >> 4;
+		dst[0] = dst[2] = out[0];
+		return;
+	}
+	out[0] = (2 * vsum[1] + 2 * vsum[0] + 8) >> 4;
+	for (int x = 1; x < width - 1; x++)
+		out[x] = (vsum[x - 1] + 2 * vsum[x] + vsum[x + 1] + 8) >> 4;
+	out[width - 1] = (2 * vsum[width - 2] + 2 * vsum[width - 1] + 8) >> 4;
+
+	dst[0] = out[1];
+	dst[width + 1] = out[width - 2];
+}
+
+void SobelCvStage::processBand(unsigned int index)
+{
+	Band &band = bands_[index];
+	int width = info_.width, height = info_.height;
+	int row_size = width + 2;
+	uint8_t *rows[3] = { &band.blurred[0], &band.blurred[row_size], &band.blurred[2 * row_size] };
+
+	// rows[0..2] hold the blurred rows y - 1, y and y + 1. Above the top of the image we
+	// reflect, so blurred row -1 is the same as blurred row 1.
+	int y = band.y_start;
+	blurRow(band, y, rows[1]);
+	if (y > 0)
+		blurRow(band, y - 1, rows[0]);
+	else if (height > 1)
+		blurRow(band, 1, rows[0]);
+	else
+		memcpy(rows[0], rows[1], row_size);
+
+	for (; y < static_cast<int>(band.y_end); y++)
+	{
+		if (y + 1 < height)
+			blurRow(band, y + 1, rows[2]);
+		else
+			memcpy(rows[2], rows[0], row_size);
+
+		// Nothing needs this source row any more, so we can overwrite it.
+		uint8_t const *b0 = rows[0] + 1, *b1 = rows[1] + 1, *b2 = rows[2] + 1;
+		uint8_t *out = image_ + y * info_.stride;
+		for (int x = 0; x < width; x++)
+		{
+			int gx = (b0[x + 1] - b0[x - 1]) + 2 * (b1[x + 1] - b1[x - 1]) + (b2[x + 1] - b2[x - 1]);
+			int gy = (b2[x - 1] + 2 * b2[x] + b2[x + 1]) - (b0[x - 1] + 2 * b0[x] + b0[x + 1]);
+			gx = std::min(std::abs(gx), 255);
+			gy = std::min(std::abs(gy), 255);
+			out[x] = (gx + gy + 1) >> 1;
+		}
+
+		std::swap(rows[0], rows[1]);
+		std::swap(rows[1], rows[2]);
+	}
+
+	// Our share of the chroma, which just gets set to neutral.
+	size_t chroma_size = (info_.stride * info_.height) / 2;
+	size_t start = chroma_size * index / bands_.size(), end = chroma_size * (index + 1) / bands_.size();
+	memset(image_ + info_.stride * info_.height + start, 128, end - start);
+}
+
+void SobelCvStage::processGeneric(uint8_t *ptr)
+{
 	//Everything beyond this point is image processing...
 
 	uint8_t value = 128;
-	int num = (info.stride * info.height) / 2;
-	Mat src = Mat(info.height, info.width, CV_8U, ptr, info.stride);
+	int num = (info_.stride * info_.height) / 2;
+	Mat src = Mat(info_.height, info_.width, CV_8U, ptr, info_.stride);
 	int scale = 1;
 	int delta = 0;
 	int ddepth = CV_16S;
 
-	memset(ptr + info.stride * info.height, value, num);
+	memset(ptr + info_.stride * info_.height, value, num);
 
 	// Remove noise by blurring with a Gaussian filter ( kernal size = 3 )
 	GaussianBlur(src, src, Size(3, 3), 0, 0, BORDER_DEFAULT);
@@ -88,8 +337,6 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 
 	//weight the x and y gradients and add their magnitudes
 	addWeighted(grad_x, 0.5, grad_y, 0.5, 0, src);
-
-	return false;
 }
 
 static PostProcessingStage *Create(LibcameraApp *app)
@@ -20,6 +20,7 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	gate_.Read(params);
 
 	initialise();
 
@@ -77,6 +78,12 @@ void TfStage::Configure()
 	else if (config_->verbose)
 		LOG(1, "TfStage: no low resolution stream");
 
+	if (lores_stream_)
+	{
+		crop_x_ = next_crop_x_ = ((lores_info_.width - tf_w_) / 2) & ~1;
+		crop_y_ = next_crop_y_ = ((lores_info_.height - tf_h_) / 2) & ~1;
+	}
+
 	main_stream_ = app_->GetMainStream();
 	if (main_stream_)
 	{
@@ -95,9 +102,12 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 	if (!lores_stream_)
 		return false;
 
+	// Always let the gate see the request, even if we aren't going to run now.
+	bool active = gate_.Update(*completed_request);
+
 	{
 		std::unique_lock<std::mutex> lck(future_mutex_);
-		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
+		if (active && config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
 			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
@@ -106,6 +116,18 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
 			// memory into cached memory, which is then *much* quicker.
 			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			lores_copy_sequence_ = completed_request->sequence;
+
+			// Crop around the centre of the active region when asked, otherwise from the
+			// centre of the image.
+			if (gate_.UseRegion())
+			{
+				libcamera::Rectangle r = gate_.Region(lores_info_.width, lores_info_.height);
+				int x = r.x + static_cast<int>(r.width / 2) - static_cast<int>(tf_w_ / 2);
+				int y = r.y + static_cast<int>(r.height / 2) - static_cast<int>(tf_h_ / 2);
+				next_crop_x_ = std::clamp<int>(x, 0, lores_info_.width - tf_w_) & ~1;
+				next_crop_y_ = std::clamp<int>(y, 0, lores_info_.height - tf_h_) & ~1;
+			}
 
 			future_ = std::make_unique<std::future<void>>();
 			*future_ = std::async(std::launch::async, [this] {
@@ -119,6 +141,9 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	applyResults(completed_request);
+	if (gate_.Enabled())
+		completed_request->post_process_metadata.Set(std::string(Name()) + ".age",
+													 gate_.Age(completed_request->sequence));
 
 	return false;
 }
@@ -128,7 +153,7 @@ void TfStage::runInference()
 	int input = interpreter_->inputs()[0];
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
+	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info, next_crop_x_, next_crop_y_);
 
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
 	{
@@ -147,6 +172,9 @@ void TfStage::runInference()
 		throw std::runtime_error("TfStage: Failed to invoke TFLite");
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
+	crop_x_ = next_crop_x_;
+	crop_y_ = next_crop_y_;
+	gate_.ResultsFrom(lores_copy_sequence_);
 	interpretOutputs();
 }
 
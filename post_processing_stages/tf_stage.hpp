@@ -21,6 +21,7 @@
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 
+#include "post_processing_stages/activity_gate.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 // The TfStage is a convenient base class from which post processing stages using
@@ -88,6 +89,13 @@ protected:
 	libcamera::Stream *lores_stream_;
 	StreamInfo lores_info_;
 
+	// Where the image given to TFLite was cropped from in the lores image. Normally this
+	// is the centre, but when gated on an active region it follows the activity. These
+	// describe the image that produced the current outputs.
+	unsigned int crop_x_, crop_y_;
+	// Whether the crop follows the activity, rather than staying in the centre.
+	bool cropFollowsActivity() const { return gate_.UseRegion(); }
+
 	// The stage may or may not make use of the larger or "main" image stream.
 	libcamera::Stream *main_stream_;
 	StreamInfo main_stream_info_;
@@ -102,5 +110,8 @@ private:
 	std::mutex future_mutex_;
 	std::unique_ptr<std::future<void>> future_;
 	std::vector<uint8_t> lores_copy_;
+	unsigned int lores_copy_sequence_;
+	unsigned int next_crop_x_, next_crop_y_;
 	std::mutex output_mutex_;
+	ActivityGate gate_;
 };
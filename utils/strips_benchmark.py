@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Copyright (C) 2021, Raspberry Pi (Trading) Limited
+#
+# strips_benchmark.py - measure JPEG encode latency against the number of strips
+
+# Runs libcamera-still and libcamera-vid (with the mjpeg codec) for a range of strip
+# counts, and reports the encode latency that the apps print at verbosity level 2.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+
+def run_executable(args):
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if p.returncode:
+        print("ERROR:", ' '.join(args), "failed, return code", p.returncode)
+        sys.exit(1)
+    return p.stdout.decode('utf-8')
+
+
+def still_latency(exe_dir, output_dir, strips, repeats):
+    executable = os.path.join(exe_dir, 'libcamera-still')
+    output_jpg = os.path.join(output_dir, 'strips.jpg')
+    times = []
+    for _ in range(repeats):
+        log = run_executable([executable, '-t', '500', '-n', '-v', '2', '--strips', str(strips),
+                              '-o', output_jpg])
+        match = re.search(r'JPEG size is \d+, encode time ([\d.]+)ms', log)
+        if not match:
+            print("ERROR: no encode time found for libcamera-still")
+            sys.exit(1)
+        times.append(float(match.group(1)))
+    os.remove(output_jpg)
+    return min(times)
+
+
+def vid_latency(exe_dir, output_dir, strips, width, height):
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    output_mjpeg = os.path.join(output_dir, 'strips.mjpeg')
+    log = run_executable([executable, '-t', '3000', '-n', '-v', '2', '--codec', 'mjpeg',
+                          '--width', str(width), '--height', str(height),
+                          '--mjpeg-strips', str(strips), '-o', output_mjpeg])
+    match = re.search(r'Output \d+ frames, average latency ([\d.]+)ms', log)
+    if not match:
+        print("ERROR: no latency found for libcamera-vid")
+        sys.exit(1)
+    os.remove(output_mjpeg)
+    return float(match.group(1))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='JPEG strip encoding benchmark')
+    parser.add_argument('--exe-dir', '-d', action='store', default='build',
+                        help='Directory name for executables to test')
+    parser.add_argument('--output-dir', '-o', action='store', default='.',
+                        help='Directory name for output files')
+    parser.add_argument('--strips', '-s', action='store', default='1,2,3,4,6,8',
+                        help='List of strip counts to try')
+    parser.add_argument('--repeats', '-r', action='store', type=int, default=3,
+                        help='Number of stills to capture for each strip count (the fastest is reported)')
+    parser.add_argument('--width', action='store', type=int, default=1920,
+                        help='Video width')
+    parser.add_argument('--height', action='store', type=int, default=1080,
+                        help='Video height')
+    args = parser.parse_args()
+    exe_dir = args.exe_dir.rstrip('/')
+    strip_counts = [int(s) for s in args.strips.split(',')]
+
+    print("Strips  Still encode (ms)  Video latency (ms)")
+    for strips in strip_counts:
+        still = still_latency(exe_dir, args.output_dir, strips, args.repeats)
+        vid = vid_latency(exe_dir, args.output_dir, strips, args.width, args.height)
+        print(f"{strips:6d}  {still:17.1f}  {vid:18.1f}")
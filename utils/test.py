@@ -15,6 +15,7 @@ import argparse
 import json
 import os
 import os.path
+import re
 import subprocess
 import sys
 from timeit import default_timer as timer
@@ -32,7 +33,7 @@ def check_exists(file, preamble):
         raise TestFailure(preamble + ": " + file + " not found")
 
 
-def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt')):
+def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mp4', '.ts', '.ring', '.mjpeg', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -188,6 +189,14 @@ def test_still(exe_dir, output_dir):
     check_time(time_taken, 1.2, 8, "test_still: jpg test")
     check_size(output_jpg, 1024, "test_still: jpg test")
 
+    # "strips test". As above, but encode the jpg in parallel strips.
+    print("    strips test")
+    retcode, time_taken = run_executable([executable, '-t', '1000', '--strips', '4', '-o', output_jpg], logfile)
+    check_retcode(retcode, "test_still: strips test")
+    check_time(time_taken, 1.2, 8, "test_still: strips test")
+    check_size(output_jpg, 1024, "test_still: strips test")
+    check_jpeg(output_jpg, "test_still: strips test")
+
     # "png test". As above, but write a png.
     print("    png test")
     retcode, time_taken = run_executable(
@@ -331,6 +340,25 @@ def check_timestamps(file, preamble):
         raise TestFailure(preamble + " - timestamps not increasing")
 
 
+def check_allocations(logfile, video_limit, preamble, audio_limit=None):
+    # The libav encoder logs how many frames and buffers it allocated when it closes.
+    with open(logfile) as f:
+        log = f.read()
+    counts = [int(n) for n in re.findall(r'libav: allocated (\d+) video frames', log)]
+    if not counts:
+        raise TestFailure(preamble + " failed, no video frame count in log")
+    if max(counts) > video_limit:
+        raise TestFailure(preamble + " failed, allocated " + str(max(counts)) + " video frames")
+    if audio_limit is None:
+        return
+    counts = [int(n) for n in re.findall(r'libav: allocated (\d+) audio frame buffers', log)]
+    counts += [int(n) for n in re.findall(r'libav: allocated audio sample buffers (\d+) times', log)]
+    if not counts:
+        raise TestFailure(preamble + " failed, no audio buffer counts in log")
+    if max(counts) > audio_limit:
+        raise TestFailure(preamble + " failed, allocated " + str(max(counts)) + " audio buffers")
+
+
 def test_vid(exe_dir, output_dir):
     executable = os.path.join(exe_dir, 'libcamera-vid')
     output_h264 = os.path.join(output_dir, 'test.h264')
@@ -362,6 +390,34 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: mjpeg test")
     check_size(output_mjpeg, 1024, "test_vid: mjpeg test")
 
+    # "mjpeg strips test". As above, but encode each frame in parallel strips.
+    print("    mjpeg strips test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
+                                          '--mjpeg-threads', '2', '--mjpeg-strips', '4',
+                                          '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg strips test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg strips test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg strips test")
+
+    # "h264 drop test". Few encoder input buffers, dropping frames rather than waiting.
+    print("    h264 drop test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--h264-buffers', '2',
+                                          '--h264-overflow', 'drop', '-o', output_h264],
+                                         logfile)
+    check_retcode(retcode, "test_vid: h264 drop test")
+    check_time(time_taken, 2, 6, "test_vid: h264 drop test")
+    check_size(output_h264, 1024, "test_vid: h264 drop test")
+
+    # "mjpeg rate control test". Let the quality vary to hit a target bitrate.
+    print("    mjpeg rate control test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
+                                          '--bitrate', '2000000', '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg rate control test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg rate control test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg rate control test")
+
     # "segment test". As above, write the output in single frame segements.
     print("    segment test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -372,6 +428,113 @@ def test_vid(exe_dir, output_dir):
     # A bug in commit b20dc097621a trunctated each jpg to 4096 bytes, so check against 4100:
     check_size(os.path.join(output_dir, 'test035.jpg'), 4100, "test_vid: segment test")
 
+    # "h264 segment test". Segments should start on time, with the encoder being asked for keyframes.
+    print("    h264 segment test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--segment', '500', '--inline',
+                                          '-o', os.path.join(output_dir, 'test%03d.h264')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: h264 segment test")
+    check_time(time_taken, 2, 6, "test_vid: h264 segment test")
+    check_size(os.path.join(output_dir, 'test002.h264'), 1024, "test_vid: h264 segment test")
+
+    # "segment quota test". Segments are preallocated and trimmed back, and the oldest get deleted.
+    print("    segment quota test")
+    retcode, time_taken = run_executable([executable, '-t', '4000', '--segment', '500', '--inline',
+                                          '--bitrate', '4000000', '--segment-quota', '1',
+                                          '-o', os.path.join(output_dir, 'quota%03d.h264')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: segment quota test")
+    check_time(time_taken, 4, 8, "test_vid: segment quota test")
+    if os.path.exists(os.path.join(output_dir, 'quota000.h264')):
+        raise TestFailure("test_vid: segment quota test failed, oldest segment not deleted")
+
+    # "mp4 test". Write a fragmented MP4 file, with a new fragment every half second.
+    print("    mp4 test")
+    output_mp4 = os.path.join(output_dir, 'test.mp4')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--mp4-fragment', '500', '-o', output_mp4],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mp4 test")
+    check_time(time_taken, 2, 6, "test_vid: mp4 test")
+    check_size(output_mp4, 1024, "test_vid: mp4 test")
+    with open(output_mp4, 'rb') as f:
+        if f.read(8)[4:] != b'ftyp':
+            raise TestFailure("test_vid: mp4 test failed, no ftyp box at start of file")
+
+    # "mpegts test". Write H.264 in a transport stream, which must be whole 188 byte packets.
+    print("    mpegts test")
+    output_ts = os.path.join(output_dir, 'test.ts')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--mpegts', '-o', output_ts], logfile)
+    check_retcode(retcode, "test_vid: mpegts test")
+    check_time(time_taken, 2, 6, "test_vid: mpegts test")
+    check_size(output_ts, 1024, "test_vid: mpegts test")
+    with open(output_ts, 'rb') as f:
+        data = f.read()
+    if len(data) % 188 or any(data[i] != 0x47 for i in range(0, len(data), 188)):
+        raise TestFailure("test_vid: mpegts test failed, bad transport stream packets")
+
+    # "libav test". Encode through libav, which should recycle its frames and buffers rather than
+    # allocating more as it goes, so no more than it can have in flight with 6 camera buffers.
+    print("    libav test")
+    output_libav = os.path.join(output_dir, 'libav.mp4')
+    retcode, time_taken = run_executable([executable, '-t', '4000', '-v', '2', '--codec', 'libav',
+                                          '--buffer-count', '6', '-o', output_libav], logfile)
+    check_retcode(retcode, "test_vid: libav test")
+    check_time(time_taken, 4, 8, "test_vid: libav test")
+    check_size(output_libav, 1024, "test_vid: libav test")
+    check_allocations(logfile, 6, "test_vid: libav test")
+
+    # "libav audio test". As above, but with audio too, whose encoder should hold onto very few buffers.
+    print("    libav audio test")
+    retcode, time_taken = run_executable([executable, '-t', '4000', '-v', '2', '--codec', 'libav', '--libav-audio',
+                                          '--buffer-count', '6', '-o', output_libav], logfile)
+    check_retcode(retcode, "test_vid: libav audio test")
+    check_time(time_taken, 4, 8, "test_vid: libav audio test")
+    check_size(output_libav, 1024, "test_vid: libav audio test")
+    check_allocations(logfile, 6, "test_vid: libav audio test", audio_limit=4)
+
+    # "simulcast test". H.264 of the main stream and MJPEG of the lores stream at the same time.
+    print("    simulcast test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--lores-width', '320', '--lores-height', '240',
+                                          '--simulcast', 'stream=lores,codec=mjpeg,output=' + output_mjpeg,
+                                          '-o', output_h264],
+                                         logfile)
+    check_retcode(retcode, "test_vid: simulcast test")
+    check_time(time_taken, 2, 6, "test_vid: simulcast test")
+    check_size(output_h264, 1024, "test_vid: simulcast test")
+    check_size(output_mjpeg, 1024, "test_vid: simulcast test")
+
+    # "multiple output test". The same H.264 goes to two files and over udp.
+    print("    multiple output test")
+    output_h264_2 = os.path.join(output_dir, 'test2.h264')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264, '-o', output_h264_2,
+                                          '-o', 'udp://127.0.0.1:5006'], logfile)
+    check_retcode(retcode, "test_vid: multiple output test")
+    check_time(time_taken, 2, 6, "test_vid: multiple output test")
+    check_size(output_h264, 1024, "test_vid: multiple output test")
+    if os.path.getsize(output_h264) != os.path.getsize(output_h264_2):
+        raise TestFailure("test_vid: multiple output test failed, output files differ")
+
+    # "rtp test". Send H.264 as RTP packets, which no one needs to be listening for.
+    print("    rtp test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--rtp-pacing', '20000000',
+                                          '-o', 'rtp://127.0.0.1:5004'], logfile)
+    check_retcode(retcode, "test_vid: rtp test")
+    check_time(time_taken, 2, 6, "test_vid: rtp test")
+
+    # "tcp listen test". The server mustn't wait for clients before recording starts.
+    print("    tcp listen test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--listen',
+                                          '-o', 'tcp://0.0.0.0:8554'], logfile)
+    check_retcode(retcode, "test_vid: tcp listen test")
+    check_time(time_taken, 2, 6, "test_vid: tcp listen test")
+
+    # "http test". Serve MJPEG over HTTP, with no one watching.
+    print("    http test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
+                                          '-o', 'http://0.0.0.0:8080/stream.mjpg'], logfile)
+    check_retcode(retcode, "test_vid: http test")
+    check_time(time_taken, 2, 6, "test_vid: http test")
+
     # "circular test". Test circular buffer (really we should wait for it to wrap...)
     print("    circular test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular',
@@ -380,6 +543,24 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: circular test")
     check_size(output_circular, 1024, "test_vid: circular test")
 
+    # "circular file test". The circular buffer lives in a file, which is left behind for next time.
+    print("    circular file test")
+    circular_file = os.path.join(output_dir, 'circular.ring')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular', '4',
+                                          '--circular-file', circular_file, '-o', output_circular], logfile)
+    check_retcode(retcode, "test_vid: circular file test")
+    check_time(time_taken, 2, 6, "test_vid: circular file test")
+    check_size(output_circular, 1024, "test_vid: circular file test")
+    check_size(circular_file, 4 << 20, "test_vid: circular file test")
+
+    # "circular dump test". Only the last part of the circular buffer gets saved.
+    print("    circular dump test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular', '4',
+                                          '--circular-dump', '500', '-o', output_circular], logfile)
+    check_retcode(retcode, "test_vid: circular dump test")
+    check_time(time_taken, 2, 6, "test_vid: circular dump test")
+    check_size(output_circular, 1024, "test_vid: circular dump test")
+
     # "pause test". Should be no output file if we start 'paused'.
     print("    pause test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline',